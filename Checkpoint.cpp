@@ -0,0 +1,137 @@
+#include "Checkpoint.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char kMagic[8] = {'M', 'T', 'A', 'C', 'K', 'P', 'T', 0};
+// Increase whenever the layout of a checkpoint changes.
+const uint32_t kFormatVersion = 3;
+const uint32_t kByteOrder = 0x01020304;
+
+struct Header {
+  char magic[8];
+  uint32_t format_version;
+  uint32_t byte_order;
+  uint32_t int_size;
+  uint32_t long_size;
+  uint32_t double_size;
+  uint32_t padding;
+};
+
+Header MakeHeader() {
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.format_version = kFormatVersion;
+  header.byte_order = kByteOrder;
+  header.int_size = sizeof(int);
+  header.long_size = sizeof(long);
+  header.double_size = sizeof(double);
+  header.padding = 0;
+  return header;
+}
+
+}  // namespace
+
+CheckpointWriter::CheckpointWriter(const string& path):
+    path(path), temporary_path(path + ".tmp"),
+    file(fopen(temporary_path.c_str(), "wb")), position(0), ok(true) {
+  Write(MakeHeader());
+}
+
+CheckpointWriter::~CheckpointWriter() {
+  if (file) {
+    fclose(file);
+    remove(temporary_path.c_str());
+  }
+}
+
+void CheckpointWriter::WriteBits(const vector<bool>& values) {
+  vector<char> bytes(values.begin(), values.end());
+  WriteArray(bytes);
+}
+
+bool CheckpointWriter::Close() {
+  if (!file)
+    return false;
+  ok = fclose(file) == 0 && ok;
+  file = 0;
+  if (ok)
+    ok = rename(temporary_path.c_str(), path.c_str()) == 0;
+  if (!ok)
+    remove(temporary_path.c_str());
+  return ok;
+}
+
+void CheckpointWriter::WriteBytes(const void* data, long size) {
+  if (!Ok())
+    return;
+  if (fwrite(data, 1, size, file) != static_cast<size_t>(size))
+    ok = false;
+  position += size;
+}
+
+void CheckpointWriter::Pad() {
+  static const char zeros[8] = {0};
+  if (position % 8 != 0)
+    WriteBytes(zeros, 8 - position % 8);
+}
+
+CheckpointReader::CheckpointReader(const string& path):
+    data(0), size(0), position(0), ok(false) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size >= static_cast<long>(sizeof(Header))) {
+    void* mapped = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      data = static_cast<const char*>(mapped);
+      size = info.st_size;
+    }
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (!data)
+    return;
+
+  ok = true;
+  Header expected = MakeHeader();
+  Header header;
+  if (Read(header) && memcmp(&header, &expected, sizeof(Header)) != 0)
+    Fail();
+}
+
+CheckpointReader::~CheckpointReader() {
+  if (data)
+    munmap(const_cast<char*>(data), size);
+}
+
+bool CheckpointReader::ReadBits(vector<bool>& values) {
+  vector<char> bytes;
+  if (!ReadArray(bytes))
+    return false;
+  values.assign(bytes.begin(), bytes.end());
+  return true;
+}
+
+bool CheckpointReader::ReadBytes(void* output, long count) {
+  if (!ok || count > size - position)
+    return Fail();
+  memcpy(output, data + position, count);
+  position += count;
+  return true;
+}
+
+bool CheckpointReader::Skip() {
+  if (!ok)
+    return false;
+  long padded = (position + 7) / 8 * 8;
+  if (padded > size)
+    return Fail();
+  position = padded;
+  return true;
+}
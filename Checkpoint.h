@@ -0,0 +1,127 @@
+#ifndef __CHECKPOINT_H
+#define __CHECKPOINT_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Binary checkpoint files. A checkpoint is written in one sequential pass and
+// read back from a memory mapping: values and arrays are stored in the
+// in-memory layout of this machine, so reading them is a bounds check and a
+// copy, without parsing. Every array starts at a multiple of 8 bytes, after
+// its element count.
+//
+// The file starts with a header holding a magic string, the format version
+// and the sizes of the basic types; a file written by another version or on
+// a different architecture is rejected.
+//
+// The writer fills a temporary file next to path and renames it to path on
+// Close, so readers, including ones mapping the old file, never see a
+// partly written one.
+class CheckpointWriter {
+ public:
+  // Opens the temporary file and writes the header.
+  explicit CheckpointWriter(const string& path);
+  // Drops the temporary file unless Close succeeded.
+  ~CheckpointWriter();
+
+  // False once opening or some write failed.
+  bool Ok() const {return file != 0 && ok;};
+
+  // T must be trivially copyable.
+  template <class T>
+  void Write(const T& value) {
+    WriteBytes(&value, sizeof(T));
+  }
+  template <class T>
+  void WriteArray(const vector<T>& values) {
+    Write(static_cast<long>(values.size()));
+    Pad();
+    if (!values.empty())
+      WriteBytes(values.data(), values.size() * sizeof(T));
+  }
+  // One byte per element.
+  void WriteBits(const vector<bool>& values);
+
+  // Flushes and closes the file, and moves it to path. Returns true if every
+  // write succeeded.
+  bool Close();
+
+ private:
+  void WriteBytes(const void* data, long size);
+  // Pads with zeros to a multiple of 8 bytes.
+  void Pad();
+
+  string path;
+  string temporary_path;
+  FILE* file;
+  long position;
+  bool ok;
+};
+
+class CheckpointReader {
+ public:
+  // Maps path and checks the header.
+  explicit CheckpointReader(const string& path);
+  ~CheckpointReader();
+
+  // False once mapping, the header check or some read failed. Reads after a
+  // failure leave their output untouched.
+  bool Ok() const {return ok;};
+
+  template <class T>
+  bool Read(T& value) {
+    return ReadBytes(&value, sizeof(T));
+  }
+  template <class T>
+  bool ReadArray(vector<T>& values) {
+    long count;
+    if (!Read(count) || !Skip() || count < 0 ||
+        count > (size - position) / static_cast<long>(sizeof(T)))
+      return Fail();
+    values.resize(count);
+    return count == 0 || ReadBytes(values.data(), count * sizeof(T));
+  }
+  bool ReadBits(vector<bool>& values);
+  // Like ReadArray, but returns a pointer into the mapping instead of a copy.
+  // It stays valid while the reader lives. Null on failure.
+  template <class T>
+  const T* MapArray(long& count) {
+    if (!Read(count) || !Skip() || count < 0 ||
+        count > (size - position) / static_cast<long>(sizeof(T))) {
+      Fail();
+      return 0;
+    }
+    const T* values = reinterpret_cast<const T*>(data + position);
+    position += count * sizeof(T);
+    return values;
+  }
+
+  // Reads a value and checks it equals expected, for the layout of the data
+  // the checkpoint is restored into.
+  template <class T>
+  bool Expect(const T& expected) {
+    T value;
+    return Read(value) && (value == expected || Fail());
+  }
+  bool ExpectBits(const vector<bool>& expected) {
+    vector<bool> values;
+    return ReadBits(values) && (values == expected || Fail());
+  }
+
+ private:
+  bool ReadBytes(void* data, long count);
+  // Skips the padding written before an array.
+  bool Skip();
+  bool Fail() {ok = false; return false;};
+
+  const char* data;
+  long size;
+  long position;
+  bool ok;
+};
+
+#endif // __CHECKPOINT_H
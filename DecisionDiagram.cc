@@ -0,0 +1,213 @@
+#include "DecisionDiagram.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <functional>
+
+DecisionDiagram::DecisionDiagram(const vector<int>& domain_sizes):
+    domain_sizes(domain_sizes) {
+}
+
+size_t DecisionDiagram::KeyHash::operator()(const vector<int>& key) const {
+  size_t hash = key.size();
+  for (unsigned int i = 0; i < key.size(); ++i)
+    hash = hash * 1000003 ^ static_cast<size_t>(key[i]);
+  return hash;
+}
+
+DecisionDiagram::Node DecisionDiagram::Leaf(double value) {
+  // -0.0 and 0.0 are the same leaf.
+  if (value == 0)
+    value = 0;
+  unordered_map<double, Node>::iterator found = leaves.find(value);
+  if (found != leaves.end())
+    return found->second;
+  Node node = vars.size();
+  vars.push_back(-1);
+  values.push_back(value);
+  offsets.push_back(children.size());
+  leaves[value] = node;
+  return node;
+}
+
+DecisionDiagram::Node DecisionDiagram::Branch(int var, const vector<Node>& branch_children) {
+  bool same = true;
+  for (unsigned int v = 1; v < branch_children.size() && same; ++v)
+    same = branch_children[v] == branch_children[0];
+  if (same)
+    return branch_children[0];
+
+  vector<int>& key = branch_key;
+  key.assign(1, var);
+  key.insert(key.end(), branch_children.begin(), branch_children.end());
+  unordered_map<vector<int>, Node, KeyHash>::iterator found = branches.find(key);
+  if (found != branches.end())
+    return found->second;
+  Node node = vars.size();
+  vars.push_back(var);
+  values.push_back(0);
+  offsets.push_back(children.size());
+  children.insert(children.end(), branch_children.begin(), branch_children.end());
+  branches[key] = node;
+  return node;
+}
+
+DecisionDiagram::Node DecisionDiagram::Apply(Node first, Node second, Op op) {
+  if (IsLeaf(first) && IsLeaf(second)) {
+    double x = values[first];
+    double y = values[second];
+    switch (op) {
+      case ADD: return Leaf(x + y);
+      case MULTIPLY: return Leaf(x * y);
+      case MAX: return Leaf(max(x, y));
+      case MIN: return Leaf(min(x, y));
+      default: return Leaf(fabs(x - y));
+    }
+  }
+  // Products with 0 and 1 need no recursion.
+  if (op == MULTIPLY) {
+    if (IsLeaf(first) && values[first] == 0)
+      return first;
+    if (IsLeaf(second) && values[second] == 0)
+      return second;
+    if (IsLeaf(first) && values[first] == 1)
+      return second;
+    if (IsLeaf(second) && values[second] == 1)
+      return first;
+  }
+
+  long key = (static_cast<long>(first) << 32) + second;
+  unordered_map<long, Node>::iterator found = applied[op].find(key);
+  if (found != applied[op].end())
+    return found->second;
+
+  int first_var = IsLeaf(first) ? INT_MAX : vars[first];
+  int second_var = IsLeaf(second) ? INT_MAX : vars[second];
+  int var = min(first_var, second_var);
+  vector<Node> result(domain_sizes[var]);
+  for (int v = 0; v < domain_sizes[var]; ++v) {
+    result[v] = Apply(first_var == var ? Child(first, v) : first,
+        second_var == var ? Child(second, v) : second, op);
+  }
+  Node node = Branch(var, result);
+  applied[op][key] = node;
+  return node;
+}
+
+DecisionDiagram::Node DecisionDiagram::Restrict(Node node, const vector<int>& assignment) {
+  unordered_map<Node, Node> restricted;
+  function<Node(Node)> restrict = [&](Node n) -> Node {
+    if (IsLeaf(n))
+      return n;
+    unordered_map<Node, Node>::iterator found = restricted.find(n);
+    if (found != restricted.end())
+      return found->second;
+    int var = vars[n];
+    Node result;
+    if (assignment[var] >= 0) {
+      result = restrict(Child(n, assignment[var]));
+    } else {
+      vector<Node> result_children(domain_sizes[var]);
+      for (int v = 0; v < domain_sizes[var]; ++v)
+        result_children[v] = restrict(Child(n, v));
+      result = Branch(var, result_children);
+    }
+    restricted[n] = result;
+    return result;
+  };
+  return restrict(node);
+}
+
+DecisionDiagram::Node DecisionDiagram::Build(const vector<int>& build_vars,
+    const vector<vector<int> >& assignments, const vector<double>& entry_values,
+    double otherwise) {
+  vector<int> entries(assignments.size());
+  for (unsigned int i = 0; i < entries.size(); ++i)
+    entries[i] = i;
+  return BuildEntries(build_vars, 0, entries, 0, entries.size(), assignments,
+      entry_values, otherwise);
+}
+
+DecisionDiagram::Node DecisionDiagram::BuildEntries(const vector<int>& build_vars,
+    int depth, vector<int>& entries, long begin, long end,
+    const vector<vector<int> >& assignments, const vector<double>& entry_values,
+    double otherwise) {
+  if (begin == end)
+    return Leaf(otherwise);
+  if (depth == static_cast<int>(build_vars.size()))
+    return Leaf(entry_values[entries[begin]]);
+
+  // Groups the entries by the value of the variable at depth.
+  int var = build_vars[depth];
+  sort(entries.begin() + begin, entries.begin() + end, [&](int x, int y) {
+    return assignments[x][depth] < assignments[y][depth];
+  });
+  vector<Node> result(domain_sizes[var]);
+  long first = begin;
+  for (int v = 0; v < domain_sizes[var]; ++v) {
+    long last = first;
+    while (last < end && assignments[entries[last]][depth] == v)
+      ++last;
+    result[v] = BuildEntries(build_vars, depth + 1, entries, first, last,
+        assignments, entry_values, otherwise);
+    first = last;
+  }
+  return Branch(var, result);
+}
+
+double DecisionDiagram::Evaluate(Node node, const int* assignment) const {
+  while (!IsLeaf(node))
+    node = Child(node, assignment[vars[node]]);
+  return values[node];
+}
+
+double DecisionDiagram::MaxValue(Node node) {
+  if (IsLeaf(node))
+    return values[node];
+  unordered_map<Node, double>::iterator found = max_values.find(node);
+  if (found != max_values.end())
+    return found->second;
+  double result = -HUGE_VAL;
+  for (int v = 0; v < domain_sizes[vars[node]]; ++v)
+    result = max(result, MaxValue(Child(node, v)));
+  max_values[node] = result;
+  return result;
+}
+
+DecisionDiagram::Node DecisionDiagram::Copy(const DecisionDiagram& other, Node node) {
+  unordered_map<Node, Node> copied;
+  function<Node(Node)> copy = [&](Node n) -> Node {
+    if (other.IsLeaf(n))
+      return Leaf(other.Value(n));
+    unordered_map<Node, Node>::iterator found = copied.find(n);
+    if (found != copied.end())
+      return found->second;
+    int var = other.Var(n);
+    vector<Node> result_children(domain_sizes[var]);
+    for (int v = 0; v < domain_sizes[var]; ++v)
+      result_children[v] = copy(other.Child(n, v));
+    Node result = Branch(var, result_children);
+    copied[n] = result;
+    return result;
+  };
+  return copy(node);
+}
+
+long DecisionDiagram::Size(Node node) const {
+  vector<bool> seen(vars.size(), false);
+  vector<Node> stack(1, node);
+  long size = 0;
+  while (!stack.empty()) {
+    Node n = stack.back();
+    stack.pop_back();
+    if (seen[n])
+      continue;
+    seen[n] = true;
+    ++size;
+    if (!IsLeaf(n)) {
+      for (int v = 0; v < domain_sizes[vars[n]]; ++v)
+        stack.push_back(Child(n, v));
+    }
+  }
+  return size;
+}
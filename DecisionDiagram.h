@@ -0,0 +1,81 @@
+#ifndef __DECISIONDIAGRAM_H
+#define __DECISIONDIAGRAM_H
+
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Algebraic decision diagrams over multi-valued variables, i.e. functions
+// from an assignment of the variables to a double represented as a reduced,
+// ordered DAG. Variable i takes domain_sizes[i] values; variables with lower
+// indices are tested closer to the root. Nodes are shared: equal functions
+// built by the same diagram are the same node, and a test whose children are
+// all the same node is never built.
+//
+// Nodes are never freed, so a diagram is meant for one computation, e.g. one
+// solve, after which the results worth keeping are copied into a new one.
+class DecisionDiagram {
+ public:
+  typedef int Node;
+  enum Op {ADD, MULTIPLY, MAX, MIN, ABS_DIFFERENCE};
+
+  explicit DecisionDiagram(const vector<int>& domain_sizes);
+
+  Node Leaf(double value);
+  // Tests var, whose values lead to children. Every variable tested below a
+  // child must come after var.
+  Node Branch(int var, const vector<Node>& children);
+
+  bool IsLeaf(Node node) const {return vars[node] < 0;};
+  double Value(Node node) const {return values[node];};
+  int Var(Node node) const {return vars[node];};
+  Node Child(Node node, int value) const {return children[offsets[node] + value];};
+
+  // The function combining the values of first and second with op.
+  Node Apply(Node first, Node second, Op op);
+  // The function with the variables of assignment fixed, those holding -1
+  // being left free.
+  Node Restrict(Node node, const vector<int>& assignment);
+  // The function worth entry_values[i] where the variables of vars, which
+  // must be sorted, hold assignments[i], and otherwise elsewhere. The
+  // assignments must be distinct.
+  Node Build(const vector<int>& vars, const vector<vector<int> >& assignments,
+      const vector<double>& entry_values, double otherwise);
+
+  // The value at assignment, which holds every variable tested.
+  double Evaluate(Node node, const int* assignment) const;
+  double MaxValue(Node node);
+  // Copies node of other, which has the same variables, into this diagram.
+  Node Copy(const DecisionDiagram& other, Node node);
+
+  // Nodes reachable from node, and nodes built so far.
+  long Size(Node node) const;
+  long NumNodes() const {return vars.size();};
+
+ private:
+  struct KeyHash {
+    size_t operator()(const vector<int>& key) const;
+  };
+  Node BuildEntries(const vector<int>& vars, int depth, vector<int>& entries,
+      long begin, long end, const vector<vector<int> >& assignments,
+      const vector<double>& entry_values, double otherwise);
+
+  vector<int> domain_sizes;
+  // Test variable of every node, -1 for leaves, and the values of leaves.
+  vector<int> vars;
+  vector<double> values;
+  // The children of node n are children[offsets[n] ...].
+  vector<long> offsets;
+  vector<Node> children;
+
+  unordered_map<double, Node> leaves;
+  // (var, children...) of every test, and the key of the last Branch.
+  unordered_map<vector<int>, Node, KeyHash> branches;
+  vector<int> branch_key;
+  // Results of Apply by op, keyed by (first, second).
+  unordered_map<long, Node> applied[ABS_DIFFERENCE + 1];
+  unordered_map<Node, double> max_values;
+};
+
+#endif // __DECISIONDIAGRAM_H
@@ -0,0 +1,23 @@
+#include "ExperienceBuffer.h"
+
+void ExperienceBuffer::Append(const vector<int>& last_state, int action,
+    const vector<int>& curr_state) {
+  bool was_empty;
+  {
+    lock_guard<mutex> lock(buffer_mutex);
+    was_empty = pending.empty();
+    pending.insert(pending.end(), last_state.begin(), last_state.begin() + num_features);
+    pending.push_back(action);
+    pending.insert(pending.end(), curr_state.begin(), curr_state.begin() + num_features);
+  }
+  // Later appends find the buffer not empty until the next Take.
+  if (was_empty && notify)
+    notify();
+}
+
+long ExperienceBuffer::Take(vector<int>& observations) {
+  observations.resize(0);
+  lock_guard<mutex> lock(buffer_mutex);
+  observations.swap(pending);
+  return observations.size() / stride;
+}
@@ -0,0 +1,37 @@
+#ifndef __EXPERIENCEBUFFER_H
+#define __EXPERIENCEBUFFER_H
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Observations of one writer thread waiting to be merged into the
+// contextual dependency table, packed as MTA::UpdateWithNewObservations
+// expects them. Only the writer appends, so its lock is contended only for
+// the moment Take swaps the buffers.
+class ExperienceBuffer {
+ public:
+  // notify is called by an Append to an empty buffer, e.g. to wake the
+  // thread merging the buffers.
+  explicit ExperienceBuffer(int num_features,
+      function<void()> notify = function<void()>()):
+      num_features(num_features), stride(2 * num_features + 1), notify(notify) {}
+
+  void Append(const vector<int>& last_state, int action,
+      const vector<int>& curr_state);
+  // Moves the observations appended so far into observations, replacing its
+  // content, and returns their count. The old capacity of observations is
+  // reused by the next appends.
+  long Take(vector<int>& observations);
+
+ private:
+  int num_features;
+  int stride;
+  function<void()> notify;
+  mutex buffer_mutex;
+  vector<int> pending;
+};
+
+#endif // __EXPERIENCEBUFFER_H
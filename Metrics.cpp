@@ -0,0 +1,46 @@
+#include "Metrics.h"
+#include <sstream>
+
+namespace {
+
+const char* kPhaseNames[Metrics::NUM_PHASES] = {
+  "construct_transitions", "refresh_transitions", "solve", "select_best_action"
+};
+const char* kCounterNames[Metrics::NUM_COUNTERS] = {
+  "solves", "vi_iterations", "backups", "transitions_built",
+  "fictitious_transitions"
+};
+const char* kGaugeNames[Metrics::NUM_GAUGES] = {
+  "transition_bytes", "reward_bytes"
+};
+
+}  // namespace
+
+void Metrics::Reset() {
+  for (int i = 0; i < NUM_COUNTERS; ++i)
+    counters[i] = 0;
+  for (int i = 0; i < NUM_GAUGES; ++i)
+    gauges[i] = 0;
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    phase_seconds[i] = 0;
+    phase_calls[i] = 0;
+  }
+  final_residual = 0;
+}
+
+string Metrics::ToJson() const {
+  ostringstream out;
+  out << "{\"enabled\": " << (enabled ? "true" : "false") << ", \"phases\": {";
+  for (int i = 0; i < NUM_PHASES; ++i) {
+    out << (i ? ", " : "") << "\"" << kPhaseNames[i] << "\": {\"seconds\": "
+        << phase_seconds[i] << ", \"calls\": " << phase_calls[i] << "}";
+  }
+  out << "}";
+  for (int i = 0; i < NUM_COUNTERS; ++i)
+    out << ", \"" << kCounterNames[i] << "\": " << counters[i];
+  out << ", \"final_residual\": " << final_residual;
+  for (int i = 0; i < NUM_GAUGES; ++i)
+    out << ", \"" << kGaugeNames[i] << "\": " << gauges[i];
+  out << "}";
+  return out.str();
+}
@@ -0,0 +1,103 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <chrono>
+#include <string>
+
+using namespace std;
+
+// Counters and phase timers of one task.
+// Disabled by default. While disabled every call returns after one branch
+// and the clock is never read, so the calls can stay in the hot paths.
+class Metrics {
+ public:
+  enum Phase {
+    CONSTRUCT_TRANSITIONS,
+    REFRESH_TRANSITIONS,
+    SOLVE,
+    SELECT_BEST_ACTION,
+    NUM_PHASES
+  };
+  enum Counter {
+    // Calls of Task::Solve that ran value iteration.
+    SOLVES,
+    // Sweeps of value iteration.
+    VI_ITERATIONS,
+    BACKUPS,
+    // (state, action) entries of the transition function computed.
+    TRANSITIONS_BUILT,
+    // Those of them that lead to the fictitious state.
+    FICTITIOUS_TRANSITIONS,
+    NUM_COUNTERS
+  };
+  // Sizes sampled when a snapshot is taken.
+  enum Gauge {
+    TRANSITION_BYTES,
+    REWARD_BYTES,
+    NUM_GAUGES
+  };
+
+  Metrics(): enabled(false) {Reset();}
+
+  void Enable(bool enable) {enabled = enable;};
+  bool Enabled() const {return enabled;};
+  // Zeroes every counter, timer and gauge.
+  void Reset();
+
+  void Count(Counter counter, long n = 1) {
+    if (enabled)
+      counters[counter] += n;
+  }
+  void AddTime(Phase phase, double seconds) {
+    if (enabled) {
+      phase_seconds[phase] += seconds;
+      phase_calls[phase]++;
+    }
+  }
+  // Bound on the Bellman residual left by the last solve.
+  void SetResidual(double residual) {
+    if (enabled)
+      final_residual = residual;
+  }
+  void SetGauge(Gauge gauge, long value) {gauges[gauge] = value;};
+
+  long Get(Counter counter) const {return counters[counter];};
+  long Get(Gauge gauge) const {return gauges[gauge];};
+  double Seconds(Phase phase) const {return phase_seconds[phase];};
+  long Calls(Phase phase) const {return phase_calls[phase];};
+  double Residual() const {return final_residual;};
+
+  // One JSON object with every phase, counter and gauge.
+  string ToJson() const;
+
+ private:
+  bool enabled;
+  long counters[NUM_COUNTERS];
+  long gauges[NUM_GAUGES];
+  double phase_seconds[NUM_PHASES];
+  long phase_calls[NUM_PHASES];
+  double final_residual;
+};
+
+// Adds the time until the end of the scope to a phase, on a monotonic clock.
+class PhaseTimer {
+ public:
+  PhaseTimer(Metrics& metrics, Metrics::Phase phase):
+      metrics(metrics), phase(phase), timing(metrics.Enabled()) {
+    if (timing)
+      start = chrono::steady_clock::now();
+  }
+  ~PhaseTimer() {
+    if (timing)
+      metrics.AddTime(phase, chrono::duration<double>(
+          chrono::steady_clock::now() - start).count());
+  }
+
+ private:
+  Metrics& metrics;
+  Metrics::Phase phase;
+  bool timing;
+  chrono::steady_clock::time_point start;
+};
+
+#endif // __METRICS_H
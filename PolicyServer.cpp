@@ -0,0 +1,63 @@
+#include "PolicyServer.h"
+
+bool PolicyServer::Load(const string& path) {
+  shared_ptr<Policy> loaded = make_shared<Policy>(path);
+  CheckpointReader& reader = loaded->reader;
+
+  vector<char> kind;
+  vector<int> feature_size;
+  vector<bool> features;
+  int width;
+  if (!reader.ReadArray(kind) || string(kind.begin(), kind.end()) != "policy" ||
+      !reader.ReadArray(feature_size) || !reader.ReadBits(features) ||
+      feature_size.size() != features.size() ||
+      !reader.ReadArray(loaded->global_action) || !reader.Read(width))
+    return false;
+  loaded->codec = StateCodec(feature_size, features);
+  loaded->num_features = feature_size.size();
+
+  if (width == 1)
+    loaded->narrow_actions = reader.MapArray<uint8_t>(loaded->num_states);
+  else if (width == 2)
+    loaded->wide_actions = reader.MapArray<uint16_t>(loaded->num_states);
+  else
+    return false;
+  if (!reader.Ok() || loaded->num_states != loaded->codec.FlatSize())
+    return false;
+
+  // Every stored action must name a global action.
+  long num_actions = loaded->global_action.size();
+  for (long s = 0; s < loaded->num_states; ++s) {
+    long a = width == 1 ? loaded->narrow_actions[s] : loaded->wide_actions[s];
+    if (a >= num_actions)
+      return false;
+  }
+
+  atomic_store(&policy, shared_ptr<const Policy>(loaded));
+  return true;
+}
+
+int PolicyServer::Action(const vector<int>& state) const {
+  shared_ptr<const Policy> current = atomic_load(&policy);
+  if (!current || state.size() < current->num_features)
+    return -1;
+  return Action(*current, state.data());
+}
+
+int PolicyServer::Action(const int* state) const {
+  shared_ptr<const Policy> current = atomic_load(&policy);
+  if (!current)
+    return -1;
+  return Action(*current, state);
+}
+
+int PolicyServer::Action(const Policy& policy, const int* state) {
+  // The action table is indexed by the flat state, so a feature out of
+  // range would read outside the mapping.
+  if (!policy.codec.InRange(state))
+    return -1;
+  int s = policy.codec.Encode(state);
+  int a = policy.narrow_actions ? policy.narrow_actions[s] :
+      policy.wide_actions[s];
+  return policy.global_action[a];
+}
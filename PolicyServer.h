@@ -0,0 +1,57 @@
+#ifndef __POLICYSERVER_H
+#define __POLICYSERVER_H
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Checkpoint.h"
+#include "StateCodec.h"
+
+using namespace std;
+
+// Serves the greedy policy of a task exported by Task::ExportPolicy, without
+// the learner: the action table is used in place from a memory mapping, with
+// one or two bytes per state, and a lookup is one encode and one load.
+//
+// Load may be called while other threads look up actions. It switches to the
+// new policy atomically; lookups already running finish on the old one,
+// which is unmapped once the last of them returns.
+class PolicyServer {
+ public:
+  // Maps the policy at path and makes it current. Returns false and keeps
+  // the current policy if the file cannot be read.
+  bool Load(const string& path);
+
+  // Whether some policy is loaded.
+  bool Loaded() const {return static_cast<bool>(atomic_load(&policy));};
+
+  // The global action of a state holding every feature of the problem, as
+  // passed to Task::SelectBestAction. -1 if no policy is loaded, if a
+  // feature is out of range, or if the vector holds too few features.
+  int Action(const vector<int>& state) const;
+  int Action(const int* state) const;
+
+ private:
+  struct Policy {
+    explicit Policy(const string& path):
+        reader(path), num_features(0), num_states(0), narrow_actions(0),
+        wide_actions(0) {}
+    CheckpointReader reader;
+    StateCodec codec;
+    unsigned long num_features;
+    vector<int> global_action;
+    long num_states;
+    // The action of every state, in the mapping; one of them is set.
+    const uint8_t* narrow_actions;
+    const uint16_t* wide_actions;
+  };
+
+  // The action of a state under policy, or -1 if a feature is out of range.
+  static int Action(const Policy& policy, const int* state);
+
+  // Read with atomic_load and replaced with atomic_store.
+  shared_ptr<const Policy> policy;
+};
+
+#endif // __POLICYSERVER_H
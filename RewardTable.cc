@@ -0,0 +1,39 @@
+#include "RewardTable.h"
+
+using namespace std;
+
+void RewardTable::Reset(long num_states, long num_actions, double reward) {
+  this->num_states = num_states;
+  this->num_actions = num_actions;
+  rewards.assign(num_states * num_actions, reward);
+  changed_states.clear();
+  state_changed.assign(num_states, false);
+}
+
+void RewardTable::Grow(long num_states, double reward) {
+  if (num_states <= this->num_states)
+    return;
+  long old_states = this->num_states;
+  this->num_states = num_states;
+  rewards.resize(num_states * num_actions, reward);
+  state_changed.resize(num_states, true);
+  for (long state = old_states; state < num_states; ++state)
+    changed_states.push_back(state);
+}
+
+long RewardTable::MemoryBytes() const {
+  return rewards.capacity() * sizeof(double) +
+      changed_states.capacity() * sizeof(long) + state_changed.capacity() / 8;
+}
+
+void RewardTable::ClearChanges() {
+  for (unsigned long i = 0; i < changed_states.size(); ++i)
+    state_changed[changed_states[i]] = false;
+  changed_states.clear();
+}
+
+void RewardTable::SetRewards(const vector<double>& rewards) {
+  this->rewards.assign(rewards.begin(), rewards.end());
+  changed_states.clear();
+  state_changed.assign(num_states, false);
+}
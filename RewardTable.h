@@ -0,0 +1,61 @@
+#ifndef __REWARDTABLE_H
+#define __REWARDTABLE_H
+
+#include <vector>
+
+using namespace std;
+
+// Reward function of an MDP: the reward of every (state, action) pair in one
+// array, in (state, action) order, like the index of TransitionTable.
+class RewardTable {
+ public:
+  RewardTable(): num_states(0), num_actions(0) {}
+
+  // Sizes the table for num_states x num_actions pairs, all with reward.
+  // Keeps the allocated memory, and drops the changes.
+  void Reset(long num_states, long num_actions, double reward);
+  // Adds states up to num_states, every action of which has reward. The new
+  // states count as changed.
+  void Grow(long num_states, double reward);
+
+  double Get(long state, long action) const {
+    return rewards[state * num_actions + action];
+  }
+  // Setting the reward already stored does not count as a change.
+  void Set(long state, long action, double reward) {
+    double& stored = rewards[state * num_actions + action];
+    if (stored == reward)
+      return;
+    stored = reward;
+    if (!state_changed[state]) {
+      state_changed[state] = true;
+      changed_states.push_back(state);
+    }
+  }
+
+  long NumStates() const {return num_states;};
+  long NumActions() const {return num_actions;};
+  // Bytes allocated by the table.
+  long MemoryBytes() const;
+
+  // States some reward of which was changed by Set or Grow since the last
+  // ClearChanges. Every state appears once.
+  const vector<long>& ChangedStates() const {return changed_states;};
+  void ClearChanges();
+
+  // Every reward in (state, action) order, e.g. for checkpoints.
+  const vector<double>& Rewards() const {return rewards;};
+  // Replaces every reward by those of rewards, which must hold
+  // NumStates() * NumActions() of them in the same order. Drops the changes.
+  void SetRewards(const vector<double>& rewards);
+
+ private:
+  long num_states;
+  long num_actions;
+  vector<double> rewards;
+
+  vector<long> changed_states;
+  vector<bool> state_changed;
+};
+
+#endif // __REWARDTABLE_H
@@ -0,0 +1,18 @@
+#include "StateCodec.h"
+#include <cassert>
+
+StateCodec::StateCodec(const vector<int>& size, const vector<bool>& relevant):
+    size(size), strides(size.size(), 0), flat_size(1), half(size.size() / 2) {
+  assert(size.size() == relevant.size());
+  // Same order as MapFactoredStateToInt: the last relevant feature varies fastest.
+  for (int i = size.size() - 1; i >= 0; --i) {
+    if (relevant[i]) {
+      strides[i] = flat_size;
+      flat_size *= size[i];
+    }
+  }
+  for (unsigned int i = 0; i < size.size(); ++i) {
+    if (relevant[i])
+      relevant_features.push_back(i);
+  }
+}
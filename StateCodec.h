@@ -0,0 +1,75 @@
+#ifndef __STATECODEC_H
+#define __STATECODEC_H
+
+#include <vector>
+
+using namespace std;
+
+// Maps the relevant features of a factored state to a flat integer and back,
+// using the same layout as MapFactoredStateToInt and MapIntStateToVector.
+// The strides are computed once, so encoding and decoding neither allocate
+// nor check their input.
+//
+// A codec may also cover the concatenation of two states, e.g. the current
+// and next step of an FSA parent: it is then built with the feature sizes
+// repeated twice and used with the two-state Encode.
+class StateCodec {
+ public:
+  StateCodec(): flat_size(1) {}
+  StateCodec(const vector<int>& size, const vector<bool>& relevant);
+
+  // Same as MapFactoredStateToInt. Irrelevant features are ignored, and may
+  // hold -1.
+  int Encode(const vector<int>& state) const {return Encode(state.data());};
+  int Encode(const int* state) const {
+    int result = 0;
+    for (unsigned int i = 0; i < relevant_features.size(); ++i)
+      result += state[relevant_features[i]] * strides[relevant_features[i]];
+    return result;
+  }
+  // Whether every relevant feature of state is within its size, i.e.
+  // whether Encode gives a flat value below FlatSize().
+  bool InRange(const int* state) const {
+    for (unsigned int i = 0; i < relevant_features.size(); ++i) {
+      int j = relevant_features[i];
+      if (state[j] < 0 || state[j] >= size[j])
+        return false;
+    }
+    return true;
+  }
+  // Encodes first followed by second, for codecs built over both.
+  int Encode(const int* first, const int* second) const {
+    int result = 0;
+    for (unsigned int i = 0; i < relevant_features.size(); ++i) {
+      int j = relevant_features[i];
+      result += (j < half ? first[j] : second[j - half]) * strides[j];
+    }
+    return result;
+  }
+
+  // Same as MapIntStateToVector, except that only the relevant features of
+  // result are written. result must already hold every feature.
+  void Decode(int flat, vector<int>& result) const {Decode(flat, result.data());};
+  void Decode(int flat, int* result) const {
+    for (unsigned int i = 0; i < relevant_features.size(); ++i) {
+      int j = relevant_features[i];
+      result[j] = (flat / strides[j]) % size[j];
+    }
+  }
+
+  // Number of flat values, i.e. the product of the relevant feature sizes.
+  int FlatSize() const {return flat_size;};
+  // Multiplier of a feature, 0 if the feature is not relevant.
+  int Stride(int feature) const {return strides[feature];};
+  const vector<int>& RelevantFeatures() const {return relevant_features;};
+
+ private:
+  vector<int> size;
+  vector<int> strides;
+  vector<int> relevant_features;
+  int flat_size;
+  // Number of features of the first state when encoding two states.
+  int half;
+};
+
+#endif // __STATECODEC_H
@@ -0,0 +1,61 @@
+#include "StateIndex.h"
+
+// Fibonacci hashing.
+static inline unsigned long HashSlot(long key, int shift) {
+  return (static_cast<unsigned long>(key) * 11400714819323198485ul) >> shift;
+}
+
+int StateIndex::Find(long key) const {
+  if (slot_keys.empty())
+    return -1;
+  unsigned long mask = slot_keys.size() - 1;
+  for (unsigned long slot = HashSlot(key, shift); ; slot = (slot + 1) & mask) {
+    if (slot_keys[slot] == key)
+      return slot_indices[slot];
+    if (slot_keys[slot] == -1)
+      return -1;
+  }
+}
+
+int StateIndex::Insert(long key) {
+  // Keep the load factor at most one half.
+  if (2 * (count + 1) > static_cast<int>(slot_keys.size()))
+    Rehash(slot_keys.empty() ? 16 : 2 * slot_keys.size());
+
+  unsigned long mask = slot_keys.size() - 1;
+  unsigned long slot = HashSlot(key, shift);
+  while (slot_keys[slot] != -1) {
+    if (slot_keys[slot] == key)
+      return slot_indices[slot];
+    slot = (slot + 1) & mask;
+  }
+  slot_keys[slot] = key;
+  slot_indices[slot] = keys.size();
+  keys.push_back(key);
+  count++;
+  return slot_indices[slot];
+}
+
+void StateIndex::Clear() {
+  keys.clear();
+  slot_keys.clear();
+  slot_indices.clear();
+  shift = 64;
+  count = 0;
+}
+
+void StateIndex::Rehash(int new_size) {
+  slot_keys.assign(new_size, -1);
+  slot_indices.assign(new_size, 0);
+  shift = 64;
+  for (int size = new_size; size > 1; size /= 2)
+    shift--;
+  unsigned long mask = new_size - 1;
+  for (unsigned int index = 0; index < keys.size(); ++index) {
+    unsigned long slot = HashSlot(keys[index], shift);
+    while (slot_keys[slot] != -1)
+      slot = (slot + 1) & mask;
+    slot_keys[slot] = keys[index];
+    slot_indices[slot] = index;
+  }
+}
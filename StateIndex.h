@@ -0,0 +1,37 @@
+#ifndef __STATEINDEX_H
+#define __STATEINDEX_H
+
+#include <vector>
+
+using namespace std;
+
+// Numbers flat states consecutively in the order they are added, for tasks
+// that only hold the states they reach. Lookups go through an open
+// addressing hash with linear probing.
+class StateIndex {
+ public:
+  StateIndex(): shift(64), count(0) {}
+
+  // Index of key, or -1 if it was never added.
+  int Find(long key) const;
+  // Index of key, adding it with the next index if needed.
+  int Insert(long key);
+
+  long Key(int index) const {return keys[index];};
+  int Size() const {return keys.size();};
+  const vector<long>& Keys() const {return keys;};
+  void Clear();
+
+ private:
+  void Rehash(int new_size);
+
+  // Keys by index.
+  vector<long> keys;
+  // Hash slots, -1 when empty.
+  vector<long> slot_keys;
+  vector<int> slot_indices;
+  int shift;
+  int count;
+};
+
+#endif // __STATEINDEX_H
@@ -0,0 +1,158 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+using namespace std;
+
+ThreadPool::ThreadPool(int num_threads): stopping(false) {
+  for (int i = 1; i < num_threads; ++i)
+    workers.push_back(thread(&ThreadPool::WorkerMain, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> lock(loops_mutex);
+    stopping = true;
+  }
+  loops_available.notify_all();
+  for (auto& worker : workers)
+    worker.join();
+}
+
+ThreadPool::Loop::Loop(long n, long grain, int threads):
+    n(n), grain(grain), chunks((n + grain - 1) / grain), ranges(threads),
+    next_range(0), finished_chunks(0) {
+  for (int i = 0; i < threads; ++i) {
+    ranges[i].begin = chunks * i / threads;
+    ranges[i].end = chunks * (i + 1) / threads;
+  }
+}
+
+void ThreadPool::Loop::Run() {
+  int own = next_range.fetch_add(1);
+  int threads = ranges.size();
+
+  // Run the own range from the front.
+  if (own < threads) {
+    Range& range = ranges[own];
+    while (true) {
+      long chunk;
+      {
+        lock_guard<mutex> lock(range.range_mutex);
+        if (range.begin == range.end)
+          break;
+        chunk = range.begin++;
+      }
+      RunChunk(chunk);
+    }
+  } else {
+    own = 0;
+  }
+
+  // Steal from the back of the other ranges until all are empty.
+  for (int i = 1; i <= threads; ++i) {
+    Range& range = ranges[(own + i) % threads];
+    while (true) {
+      long chunk;
+      {
+        lock_guard<mutex> lock(range.range_mutex);
+        if (range.begin == range.end)
+          break;
+        chunk = --range.end;
+      }
+      RunChunk(chunk);
+    }
+  }
+}
+
+void ThreadPool::Loop::RunChunk(long chunk) {
+  (*body)(chunk * grain, min(n, (chunk + 1) * grain));
+  if (finished_chunks.fetch_add(1) + 1 == chunks) {
+    lock_guard<mutex> lock(done_mutex);
+    done.notify_all();
+  }
+}
+
+void ThreadPool::ParallelFor(long n, long grain,
+    const function<void(long, long)>& body) {
+  if (n <= 0)
+    return;
+  if (grain < 1)
+    grain = 1;
+
+  // Nothing to share.
+  if (workers.empty() || n <= grain) {
+    body(0, n);
+    return;
+  }
+
+  shared_ptr<Loop> loop(new Loop(n, grain, NumThreads()));
+  loop->body = &body;
+
+  {
+    lock_guard<mutex> lock(loops_mutex);
+    loops.push_back(loop);
+  }
+  loops_available.notify_all();
+
+  // The caller works on its own loop too.
+  loop->Run();
+
+  unique_lock<mutex> lock(loop->done_mutex);
+  loop->done.wait(lock, [&loop] {return loop->finished_chunks == loop->chunks;});
+}
+
+void ThreadPool::Enqueue(const function<void()>& job) {
+  if (workers.empty()) {
+    job();
+    return;
+  }
+  {
+    lock_guard<mutex> lock(loops_mutex);
+    jobs.push_back(job);
+  }
+  loops_available.notify_one();
+}
+
+bool ThreadPool::RunPendingJob() {
+  function<void()> job;
+  {
+    lock_guard<mutex> lock(loops_mutex);
+    if (jobs.empty())
+      return false;
+    job = jobs.front();
+    jobs.pop_front();
+  }
+  job();
+  return true;
+}
+
+void ThreadPool::WorkerMain() {
+  unique_lock<mutex> lock(loops_mutex);
+  while (true) {
+    loops_available.wait(lock, [this] {
+      return stopping || !loops.empty() || !jobs.empty();
+    });
+
+    // Loops come first: their callers are waiting for them already.
+    if (loops.empty()) {
+      if (jobs.empty())
+        return;
+      function<void()> job = jobs.front();
+      jobs.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+      continue;
+    }
+
+    shared_ptr<Loop> loop = loops.front();
+    lock.unlock();
+    loop->Run();
+    lock.lock();
+
+    // The loop has no chunks left to hand out.
+    deque<shared_ptr<Loop> >::iterator it = find(loops.begin(), loops.end(), loop);
+    if (it != loops.end())
+      loops.erase(it);
+  }
+}
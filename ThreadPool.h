@@ -0,0 +1,93 @@
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A fixed set of worker threads running parallel loops.
+// The thread calling ParallelFor takes part in the loop, so a loop always
+// completes even when every worker is busy, and loops may be nested.
+//
+// Loops are scheduled by work stealing: the chunks of a loop are split into
+// one contiguous range per thread, every thread runs its own range from the
+// front, and a thread whose range is empty steals chunks from the back of
+// the others.
+class ThreadPool {
+ public:
+  // Starts num_threads - 1 workers; the caller is the remaining thread.
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  // Number of threads taking part in a loop, including the caller.
+  int NumThreads() const {return workers.size() + 1;};
+
+  // Calls body(begin, end) on consecutive chunks of at most grain indices
+  // covering [0, n), and returns once every chunk has finished.
+  void ParallelFor(long n, long grain, const function<void(long, long)>& body);
+
+  // Queues job for a worker and returns its result through the future.
+  // Jobs run in the order they are submitted, after any pending loop chunks.
+  // Without workers the job runs right away.
+  template <class Result>
+  future<Result> Submit(const function<Result()>& job) {
+    shared_ptr<packaged_task<Result()> > task(new packaged_task<Result()>(job));
+    future<Result> result = task->get_future();
+    Enqueue([task] {(*task)();});
+    return result;
+  }
+
+  // Runs the next queued job on the calling thread. Returns false if none is
+  // queued, so a thread waiting for jobs can help with them first.
+  bool RunPendingJob();
+
+ private:
+  // Chunks [begin, end) not yet taken from the range of one thread.
+  struct Range {
+    mutex range_mutex;
+    long begin;
+    long end;
+  };
+
+  // One ParallelFor call.
+  struct Loop {
+    const function<void(long, long)>* body;
+    long n;
+    long grain;
+    long chunks;
+    // One range per thread; threads joining the loop take the next one.
+    vector<Range> ranges;
+    atomic<int> next_range;
+    atomic<long> finished_chunks;
+    mutex done_mutex;
+    condition_variable done;
+
+    Loop(long n, long grain, int threads);
+    // Runs chunks until none is left.
+    void Run();
+    void RunChunk(long chunk);
+  };
+
+  void Enqueue(const function<void()>& job);
+  void WorkerMain();
+
+  vector<thread> workers;
+  // Loops that still have chunks to hand out.
+  deque<shared_ptr<Loop> > loops;
+  // Submitted jobs not yet started.
+  deque<function<void()> > jobs;
+  // Guards loops and jobs.
+  mutex loops_mutex;
+  condition_variable loops_available;
+  bool stopping;
+};
+
+#endif // __THREADPOOL_H
@@ -0,0 +1,183 @@
+#include "TransitionTable.h"
+#include <algorithm>
+#include "Checkpoint.h"
+
+using namespace std;
+
+void TransitionTable::Reset(long num_states, long num_actions) {
+  this->num_states = num_states;
+  this->num_actions = num_actions;
+  offsets.assign(num_states * num_actions, 0);
+  lengths.assign(num_states * num_actions, 0);
+  next_states.clear();
+  probabilities.clear();
+  garbage = 0;
+  version++;
+  changed_states.clear();
+  state_changed.assign(num_states, false);
+}
+
+void TransitionTable::Grow(long num_states) {
+  if (num_states <= this->num_states)
+    return;
+  this->num_states = num_states;
+  // New states come last in (state, action) order, so their empty pairs
+  // simply extend the index arrays.
+  offsets.resize(num_states * num_actions, 0);
+  lengths.resize(num_states * num_actions, 0);
+  state_changed.resize(num_states, false);
+  version++;
+}
+
+void TransitionTable::Assign(long state, long action, const long* next,
+    const double* prob, long count) {
+  long index = state * num_actions + action;
+  long begin = offsets[index];
+  long old_count = lengths[index];
+
+  // Compare the values as they would be stored.
+  if (count == old_count && equal(next, next + count, next_states.begin() + begin,
+        [](long x, TransitionState y) {return TransitionState(x) == y;})
+      && equal(prob, prob + count, probabilities.begin() + begin,
+        [](double x, TransitionProbability y) {return TransitionProbability(x) == y;}))
+    return;
+  version++;
+  if (!state_changed[state]) {
+    state_changed[state] = true;
+    changed_states.push_back(state);
+  }
+
+  if (begin + old_count == static_cast<long>(next_states.size())) {
+    // The entry is the last one in the packed arrays, so it can simply grow
+    // or shrink. This is the case for every entry while the table is filled
+    // after a Reset.
+    next_states.resize(begin + count);
+    probabilities.resize(begin + count);
+  } else if (count <= old_count) {
+    // Fits in place.
+    garbage += old_count - count;
+  } else {
+    // Move the entry to the end.
+    garbage += old_count;
+    begin = next_states.size();
+    next_states.resize(begin + count);
+    probabilities.resize(begin + count);
+  }
+
+  copy(next, next + count, next_states.begin() + begin);
+  copy(prob, prob + count, probabilities.begin() + begin);
+  offsets[index] = begin;
+  lengths[index] = count;
+
+  // Do not let moved entries take more space than the live ones.
+  if (garbage > 1024 && garbage > NumEntries())
+    Compact();
+}
+
+long TransitionTable::MemoryBytes() const {
+  return (offsets.capacity() + lengths.capacity()) * sizeof(TransitionOffset) +
+      next_states.capacity() * sizeof(TransitionState) +
+      probabilities.capacity() * sizeof(TransitionProbability) +
+      changed_states.capacity() * sizeof(long) + state_changed.capacity() / 8;
+}
+
+void TransitionTable::ClearChanges() {
+  for (unsigned long i = 0; i < changed_states.size(); ++i)
+    state_changed[changed_states[i]] = false;
+  changed_states.clear();
+}
+
+void TransitionTable::Compact() {
+  if (garbage == 0)
+    return;
+
+  vector<TransitionState> packed_next;
+  vector<TransitionProbability> packed_prob;
+  packed_next.reserve(NumEntries());
+  packed_prob.reserve(NumEntries());
+  for (unsigned long index = 0; index < offsets.size(); ++index) {
+    long begin = offsets[index];
+    offsets[index] = packed_next.size();
+    packed_next.insert(packed_next.end(), next_states.begin() + begin,
+        next_states.begin() + begin + lengths[index]);
+    packed_prob.insert(packed_prob.end(), probabilities.begin() + begin,
+        probabilities.begin() + begin + lengths[index]);
+  }
+  next_states.swap(packed_next);
+  probabilities.swap(packed_prob);
+  garbage = 0;
+}
+
+void TransitionTable::Save(CheckpointWriter& writer) const {
+  // The entry types depend on COMPACT_TRANSITIONS.
+  writer.Write(static_cast<int>(sizeof(TransitionState)));
+  writer.Write(static_cast<int>(sizeof(TransitionProbability)));
+  writer.Write(static_cast<int>(sizeof(TransitionOffset)));
+  writer.Write(num_states);
+  writer.Write(num_actions);
+  writer.Write(garbage);
+  writer.Write(version);
+  writer.WriteArray(offsets);
+  writer.WriteArray(lengths);
+  writer.WriteArray(next_states);
+  writer.WriteArray(probabilities);
+}
+
+bool TransitionTable::Load(CheckpointReader& reader) {
+  long stored_states, stored_actions, stored_garbage, stored_version;
+  vector<TransitionOffset> stored_offsets, stored_lengths;
+  vector<TransitionState> stored_next;
+  vector<TransitionProbability> stored_probabilities;
+  if (!reader.Expect(static_cast<int>(sizeof(TransitionState))) ||
+      !reader.Expect(static_cast<int>(sizeof(TransitionProbability))) ||
+      !reader.Expect(static_cast<int>(sizeof(TransitionOffset))) ||
+      !reader.Read(stored_states) || !reader.Read(stored_actions) ||
+      !reader.Read(stored_garbage) || !reader.Read(stored_version) ||
+      !reader.ReadArray(stored_offsets) || !reader.ReadArray(stored_lengths) ||
+      !reader.ReadArray(stored_next) || !reader.ReadArray(stored_probabilities))
+    return false;
+
+  long entries = stored_next.size();
+  if (stored_states < 0 || stored_actions < 0 ||
+      static_cast<long>(stored_offsets.size()) != stored_states * stored_actions ||
+      stored_lengths.size() != stored_offsets.size() ||
+      stored_probabilities.size() != stored_next.size())
+    return false;
+  for (unsigned long i = 0; i < stored_offsets.size(); ++i) {
+    long begin = stored_offsets[i];
+    long length = stored_lengths[i];
+    if (begin < 0 || length < 0 || begin + length > entries)
+      return false;
+  }
+  for (long i = 0; i < entries; ++i) {
+    long next = stored_next[i];
+    if (next < 0 || next >= stored_states)
+      return false;
+  }
+
+  num_states = stored_states;
+  num_actions = stored_actions;
+  garbage = stored_garbage;
+  // Readers caching data derived from the old table see it changed.
+  version = max(version, stored_version) + 1;
+  offsets.swap(stored_offsets);
+  lengths.swap(stored_lengths);
+  next_states.swap(stored_next);
+  probabilities.swap(stored_probabilities);
+  changed_states.clear();
+  state_changed.assign(num_states, false);
+  return true;
+}
+
+void TransitionTable::Swap(TransitionTable& other) {
+  swap(num_states, other.num_states);
+  swap(num_actions, other.num_actions);
+  swap(garbage, other.garbage);
+  version = other.version = max(version, other.version) + 1;
+  changed_states.swap(other.changed_states);
+  state_changed.swap(other.state_changed);
+  offsets.swap(other.offsets);
+  lengths.swap(other.lengths);
+  next_states.swap(other.next_states);
+  probabilities.swap(other.probabilities);
+}
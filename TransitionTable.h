@@ -0,0 +1,113 @@
+#ifndef __TRANSITIONTABLE_H
+#define __TRANSITIONTABLE_H
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+class CheckpointWriter;
+class CheckpointReader;
+
+// Types of the stored entries. Building with COMPACT_TRANSITIONS stores next
+// states and offsets as 32 bit integers and probabilities as floats, which
+// halves the memory of a table and of the sweeps reading it. Values are
+// converted when stored and read, so the interface does not change.
+#ifdef COMPACT_TRANSITIONS
+typedef uint32_t TransitionState;
+typedef float TransitionProbability;
+typedef uint32_t TransitionOffset;
+#else
+typedef long TransitionState;
+typedef double TransitionProbability;
+typedef long TransitionOffset;
+#endif
+
+// Compressed sparse row storage of a transition function.
+// The entries of every (state, action) pair occupy the range
+// [Begin(state, action), End(state, action)) of two packed arrays holding
+// the next states and their probabilities.
+// Filling the table in (state, action) order leaves the arrays perfectly
+// packed, so a sweep over all states walks them linearly. Entries moved by
+// later updates are packed again by Compact.
+class TransitionTable {
+ public:
+  TransitionTable(): num_states(0), num_actions(0), garbage(0), version(0) {}
+
+  // Drops all entries and sizes the table for num_states x num_actions pairs.
+  // Keeps the allocated memory for the next rebuild.
+  void Reset(long num_states, long num_actions);
+  // Adds states without entries up to num_states, keeping the entries of
+  // the others. Increases the version.
+  void Grow(long num_states);
+
+  // Replaces the entries of (state, action).
+  // Entries are written in place when they fit, otherwise they are moved to
+  // the end of the packed arrays. Assigning the entries already stored leaves
+  // the table and its version untouched. With COMPACT_TRANSITIONS, next states
+  // must fit in 32 bits and probabilities are rounded to floats.
+  void Assign(long state, long action, const long* next, const double* prob,
+      long count);
+  void Assign(long state, long action, long next, double prob) {
+    Assign(state, action, &next, &prob, 1);
+  }
+
+  long Begin(long state, long action) const {
+    return offsets[state * num_actions + action];
+  }
+  long End(long state, long action) const {
+    return offsets[state * num_actions + action] +
+      lengths[state * num_actions + action];
+  }
+  long Size(long state, long action) const {
+    return lengths[state * num_actions + action];
+  }
+
+  long NextState(long entry) const {return next_states[entry];};
+  double Probability(long entry) const {return probabilities[entry];};
+
+  long NumStates() const {return num_states;};
+  long NumActions() const {return num_actions;};
+  // Number of entries currently used by some (state, action).
+  long NumEntries() const {return next_states.size() - garbage;};
+  // Bytes allocated by the table.
+  long MemoryBytes() const;
+
+  // Increased by every Reset and by every Assign that changes some entry.
+  long Version() const {return version;};
+  // States whose entries were changed by Assign since the last ClearChanges.
+  // Every state appears once.
+  const vector<long>& ChangedStates() const {return changed_states;};
+  void ClearChanges();
+
+  // Repacks the entries in (state, action) order, dropping the space left
+  // behind by entries that were moved.
+  void Compact();
+
+  // Writes the table to a checkpoint, or restores it from one. Load returns
+  // false and leaves the table untouched if the stored table is malformed.
+  // The restored table has no changes and a version above both the stored
+  // and the current one.
+  void Save(CheckpointWriter& writer) const;
+  bool Load(CheckpointReader& reader);
+  // Exchanges the entries and the changes with those of other, e.g. to
+  // install a table loaded aside. Both versions end up above both old ones.
+  void Swap(TransitionTable& other);
+
+ private:
+  long num_states;
+  long num_actions;
+  // Space in the packed arrays no longer used by any (state, action).
+  long garbage;
+  long version;
+
+  vector<long> changed_states;
+  vector<bool> state_changed;
+
+  vector<TransitionOffset> offsets;
+  vector<TransitionOffset> lengths;
+  vector<TransitionState> next_states;
+  vector<TransitionProbability> probabilities;
+};
+
+#endif // __TRANSITIONTABLE_H
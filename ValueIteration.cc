@@ -1,5 +1,7 @@
 #include "ValueIteration.h"
+#include <algorithm>
 #include <cfloat>
+#include <chrono>
 #include <cmath>
 #include <cstdlib>
 #include <iostream>
@@ -10,26 +12,226 @@ using namespace std;
 
 void ValueIteration::doValueIteration(std::vector<std::vector<double> >& rewardMatrix, std::vector<std::vector<std::vector<std::pair<long,double> > > >& transMatrix, double targetPrecision, long displayInterval)
 {
-  // record time
-  time_t start, curr;
-  double timeSoFar = 0;
+  packedRewards.Reset(numStates, numActions, 0);
+  packedTransitions.Reset(numStates, numActions);
+  vector<long> next;
+  vector<double> prob;
+  for (long i = 0; i < numStates; i++){
+    for (long j = 0; j < numActions; j++){
+      packedRewards.Set(i, j, rewardMatrix[i][j]);
+      next.resize(0);
+      prob.resize(0);
+      for (unsigned long k = 0; k < transMatrix[i][j].size(); k++){
+        next.push_back(transMatrix[i][j][k].first);
+        prob.push_back(transMatrix[i][j][k].second);
+      }
+      packedTransitions.Assign(i, j, next.data(), prob.data(), next.size());
+    }
+  }
+  doValueIteration(packedRewards, packedTransitions, targetPrecision, displayInterval);
+}
 
+void ValueIteration::doValueIteration(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long displayInterval)
+{
   // Allocate memory for values and actions
   // Question: What are values and actions?
   values.resize(numStates);
   actions.resize(numStates);
+  backups = 0;
+  iterations = 0;
+  // The bounds are computed again from scratch.
+  clearTrialChanges();
+
+  // Without predecessors, prioritized sweeping falls back to Gauss-Seidel.
+  Solver selected = solver;
+  if (backupModel && selected == PRIORITIZED_SWEEPING)
+    selected = GAUSS_SEIDEL;
+  switch (selected){
+    case GAUSS_SEIDEL:
+      doGaussSeidel(rewardTable, transTable, targetPrecision);
+      break;
+    case PRIORITIZED_SWEEPING:
+      doPrioritizedSweeping(rewardTable, transTable, targetPrecision, 0);
+      break;
+    default:
+      doJacobi(rewardTable, transTable, targetPrecision, displayInterval);
+  }
+  solvedTable = &transTable;
+  solvedVersion = transTable.Version();
+}
+
+void ValueIteration::doValueIteration(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, const vector<long>& changedStates)
+{
+  values.resize(numStates);
+  actions.resize(numStates);
+  backups = 0;
+  iterations = 0;
+  if (backupModel)
+    doGaussSeidel(rewardTable, transTable, targetPrecision);
+  else
+    doPrioritizedSweeping(rewardTable, transTable, targetPrecision, &changedStates);
+  solvedTable = &transTable;
+  solvedVersion = transTable.Version();
+}
+
+bool ValueIteration::solveForAction(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long queryState, long& bestAction, long maxBackups, const vector<long>* changedStates)
+{
+  this->queryState = queryState;
+  queryBudget = maxBackups;
+  queryStopped = false;
+  if (changedStates)
+    doValueIteration(rewardTable, transTable, targetPrecision, *changedStates);
+  else
+    doValueIteration(rewardTable, transTable, targetPrecision);
+  // A solve reaching targetPrecision may still have proven the action.
+  if (!queryStopped)
+    queryDecided(rewardTable, transTable, values, residual);
+  this->queryState = -1;
+  bestAction = queryAction;
+  return queryProven;
+}
+
+bool ValueIteration::queryDecided(const RewardTable& rewardTable, const TransitionTable& transTable, const vector<double>& current, double residualBound)
+{
+  if (queryState < 0)
+    return false;
+
+  // Bounds on the optimal action values, and the greedy action.
+  double error = residualBound / (1 - discount);
+  queryLow.assign(numActions, 0);
+  queryHigh.assign(numActions, 0);
+  double bestValue = -FLT_MAX;
+  queryAction = 0;
+  for (long j = 0; j < numActions; j++){
+    if (!actionApplicable[queryState * numActions + j])
+      continue;
+    double value = rewardTable.Get(queryState, j);
+    queryLow[j] = queryHigh[j] = value;
+    if (backupModel && transTable.Size(queryState, j) == 0){
+      // Looser bounds, without clipping to the value range.
+      double nextValue = discount * backupModel->ExpectedValue(queryState, j, current);
+      value += nextValue;
+      queryLow[j] += nextValue - discount * error;
+      queryHigh[j] += nextValue + discount * error;
+    }
+    for (long k = transTable.Begin(queryState, j); k < transTable.End(queryState, j); k++){
+      double prob = discount * transTable.Probability(k);
+      double nextValue = current[transTable.NextState(k)];
+      value += prob * nextValue;
+      queryLow[j] += prob * max(nextValue - error, minValue);
+      queryHigh[j] += prob * min(nextValue + error, maxValue);
+    }
+    if (value > bestValue){
+      bestValue = value;
+      queryAction = j;
+    }
+  }
+
+  queryProven = true;
+  for (long j = 0; j < numActions; j++){
+    if (j != queryAction && actionApplicable[queryState * numActions + j] && queryHigh[j] >= queryLow[queryAction])
+      queryProven = false;
+  }
+  queryStopped = queryProven || (queryBudget > 0 && backups >= queryBudget);
+  return queryStopped;
+}
+
+void ValueIteration::setRewardBounds(double minReward, double maxReward)
+{
+  minValue = discount < 1 ? minReward / (1 - discount) : -numeric_limits<double>::infinity();
+  maxValue = discount < 1 ? maxReward / (1 - discount) : numeric_limits<double>::infinity();
+}
+
+long ValueIteration::doRTDP(const RewardTable& rewardTable, const TransitionTable& transTable, long startState, double targetPrecision, double maxSeconds, long maxBackups)
+{
+  values.resize(numStates);
+  actions.resize(numStates);
+  trialChanges.resize(numStates, 0);
+  backups = 0;
+  iterations = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+  // Beyond the horizon discounting shrinks any change below targetPrecision.
+  long horizon = numStates;
+  if (discount < 1)
+    horizon = min(horizon, max(1L, static_cast<long>(ceil(log(targetPrecision) / log(discount)))));
+  uniform_real_distribution<double> uniform(0, 1);
+
+  bool done = false;
+  while (!done){
+    double trialChange = 0;
+    long trialStart = backups;
+    long state = startState;
+    for (long depth = 0; depth < horizon; depth++){
+      if ((maxBackups > 0 && backups >= maxBackups) ||
+          (maxSeconds > 0 && chrono::duration<double>(chrono::steady_clock::now() - start).count() >= maxSeconds)){
+        done = true;
+        break;
+      }
+
+      long bestAction;
+      double bestValue = backup(state, rewardTable, transTable, values, bestAction);
+      backups++;
+      double delta = fabs(bestValue - values[state]);
+      values[state] = bestValue;
+      actions[state] = bestAction;
+      // Right after its backup the residual of state is 0.
+      if (static_cast<long>(priority.size()) == numStates)
+        priority[state] = 0;
+      if (delta > 0){
+        if (trialChanges[state] == 0)
+          trialStates.push_back(state);
+        trialChanges[state] += delta;
+      }
+      if (delta > trialChange)
+        trialChange = delta;
+
+      // Sample the next state of the greedy action, stopping at absorbing states.
+      long begin = transTable.Begin(state, bestAction);
+      long end = transTable.End(state, bestAction);
+      if (begin == end || (end - begin == 1 && transTable.NextState(begin) == state))
+        break;
+      double u = uniform(trialRandom);
+      long k = begin;
+      for (; k < end - 1; k++){
+        u -= transTable.Probability(k);
+        if (u < 0)
+          break;
+      }
+      state = transTable.NextState(k);
+    }
+    if (backups > trialStart)
+      iterations++;
+    if (trialChange <= targetPrecision)
+      done = true;
+  }
+
+  return greedyAction(startState, rewardTable, transTable);
+}
+
+long ValueIteration::greedyAction(long state, const RewardTable& rewardTable, const TransitionTable& transTable)
+{
+  long bestAction;
+  backup(state, rewardTable, transTable, values, bestAction);
+  return bestAction;
+}
+
+void ValueIteration::doJacobi(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long displayInterval)
+{
+  // record time
+  time_t start, curr;
+  double timeSoFar = 0;
 
   time(&start);
   time(&curr);
 
-  vector<vector<double> > tempValues;
-
   // What are tempValues?
   // It's the temp values to compare changes
   // Note: Two of them initialized to all 0.
+  // They are members so their memory is reused by the next call.
   tempValues.resize(2);
   for (long i=0; i< 2; i++){
-    tempValues[i] = values;
+    tempValues[i].assign(values.begin(), values.end());
   }
 
   double currChange = FLT_MAX; 
@@ -44,54 +246,381 @@ void ValueIteration::doValueIteration(std::vector<std::vector<double> >& rewardM
     }
  
     // For each state, look for the best value that goes with best action in that state
-    for (long i=0; i< numStates; i++){
-      double bestValue = -FLT_MAX;
-      long bestAction = 0;
-      
-      for (long j = 0; j < numActions; j++){
-
-        // Action j is not available for this state i
-        if (!actionApplicable[i][j])
-          continue;
-
-        // Compute discounted reward
-        double currValue = rewardMatrix[i][j];
-        for (long k = 0; k < transMatrix[i][j].size(); k++){
-          long nextState = transMatrix[i][j][k].first;
-          double prob = transMatrix[i][j][k].second;
-          currValue +=  discount * prob * tempValues[nextIndex][nextState];
-        }
-        
-        // Seach for best discounted rewards among all actions in this state
-        if (currValue > bestValue){
-          bestValue = currValue;
-          bestAction = j;
-        }
+    // For this iteration tempValues store the best value of the state thus far
+    if (!threadPool || threadPool->NumThreads() == 1) {
+      currChange = sweep(rewardTable, transTable, 0, numStates,
+          tempValues[nextIndex], tempValues[currIndex]);
+    } else {
+      // Every chunk writes its own states and its own largest change, so the
+      // result does not depend on how the chunks are scheduled.
+      long chunks = (numStates + sweepGrain - 1) / sweepGrain;
+      chunkChanges.assign(chunks, 0);
+      const vector<double>& from = tempValues[nextIndex];
+      vector<double>& to = tempValues[currIndex];
+      threadPool->ParallelFor(numStates, sweepGrain, [&](long begin, long end) {
+        chunkChanges[begin / sweepGrain] = sweep(rewardTable, transTable,
+            begin, end, from, to);
+      });
+      currChange = 0;
+      for (long c = 0; c < chunks; c++){
+        if (chunkChanges[c] > currChange)
+          currChange = chunkChanges[c];
       }
-      
-      // For this iteration tempValues store the best value of the state thus far
-      tempValues[currIndex][i] = bestValue;
-      actions[i] = bestAction;
-    }
-    currChange = 0;
-    for (long i = 0; i < numStates; i++){
-      if (fabs(tempValues[currIndex][i]- tempValues[nextIndex][i])> currChange)
-        currChange = fabs(tempValues[currIndex][i]- tempValues[nextIndex][i]);
     }
 
+    backups += numStates;
+    iterations++;
+
     currIndex = nextIndex;
     nextIndex = (nextIndex + 1) % 2;
     //cout << " Diff: " << currChange << "\n";
+
+    // The residual of the new values is at most discount times the change.
+    if (currChange > targetPrecision &&
+        queryDecided(rewardTable, transTable, tempValues[nextIndex], discount * currChange))
+      break;
   }
 
   for (long i =0; i< numStates; i++){
     values[i] = tempValues[nextIndex][i];
   }
 
+  // The residual of the last sweep is at most discount times its change.
+  residual = discount * currChange;
+  priority.assign(numStates, residual);
+  boundsAboveTarget = residual > targetPrecision;
+
   // currChange should grows to 0.
   //cout << "time: " << difftime(curr,start) << " Diff: " << currChange << "\n";
 };
 
+void ValueIteration::doGaussSeidel(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision)
+{
+  // A single vector, updated in place.
+  tempValues.resize(1);
+  tempValues[0].assign(values.begin(), values.end());
+  vector<double>& currValues = tempValues[0];
+
+  double currChange = FLT_MAX;
+  while (currChange > targetPrecision){
+    currChange = 0;
+    for (long i = 0; i < numStates; i++){
+      long bestAction;
+      double bestValue = backup(i, rewardTable, transTable, currValues, bestAction);
+      if (fabs(bestValue - currValues[i]) > currChange)
+        currChange = fabs(bestValue - currValues[i]);
+      currValues[i] = bestValue;
+      actions[i] = bestAction;
+    }
+    backups += numStates;
+    iterations++;
+    if (currChange > targetPrecision &&
+        queryDecided(rewardTable, transTable, currValues, currChange))
+      break;
+  }
+
+  values.assign(currValues.begin(), currValues.end());
+  // Bound on the residual left by the last sweep.
+  residual = currChange;
+  priority.assign(numStates, residual);
+  boundsAboveTarget = residual > targetPrecision;
+}
+
+void ValueIteration::doPrioritizedSweeping(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, const vector<long>* seeds)
+{
+  buildPredecessors(transTable, seeds);
+
+  // Backs up in place.
+  vector<double>& currValues = values;
+
+  // priority[s] bounds the Bellman residual of s from above. Right after s is
+  // backed up its residual is 0, and a change of delta in a successor reached
+  // with probability p raises it by at most discount * p * delta.
+  // So once no bound exceeds targetPrecision, no residual does either.
+  //
+  // The queue is a bucket queue: bucket b holds the states whose bound lies in
+  // [2^b, 2^(b+1)) times targetPrecision, and the highest bucket is served
+  // first. A state is queued again only when its bound moves to a higher bucket.
+  //
+  // When re-solving, the bounds of the states outside seeds are still valid,
+  // since neither their model nor the values changed since the last solve.
+  if (!seeds || static_cast<long>(priority.size()) != numStates)
+    priority.assign(numStates, 0);
+  queuedBucket.assign(numStates, -1);
+  for (unsigned long b = 0; b < buckets.size(); b++)
+    buckets[b].resize(0);
+  long topBucket = -1;
+
+  // Bounds left above the target by an earlier solve are queued again.
+  if (seeds && boundsAboveTarget){
+    for (long i = 0; i < numStates; i++){
+      if (priority[i] > targetPrecision)
+        enqueue(i, targetPrecision, topBucket);
+    }
+  }
+
+  // A change of the value of a state made by doRTDP raises the bounds of its
+  // predecessors like a backup here does.
+  for (unsigned long n = 0; n < trialStates.size(); n++)
+    raisePredecessors(trialStates[n], trialChanges[trialStates[n]], targetPrecision, topBucket);
+  clearTrialChanges();
+
+  long numSeeds = seeds ? seeds->size() : numStates;
+  for (long n = 0; n < numSeeds; n++){
+    long i = seeds ? (*seeds)[n] : n;
+    long bestAction;
+    double bestValue = backup(i, rewardTable, transTable, currValues, bestAction);
+    actions[i] = bestAction;
+    priority[i] = fabs(bestValue - currValues[i]);
+    if (priority[i] > targetPrecision)
+      enqueue(i, targetPrecision, topBucket);
+  }
+  backups += numSeeds;
+
+  // Every bound is below 2^(topBucket + 1) times targetPrecision, so check
+  // the query whenever the top bucket empties.
+  bool stopped = topBucket >= 0 &&
+      queryDecided(rewardTable, transTable, currValues, ldexp(targetPrecision, topBucket + 1));
+  while (topBucket >= 0 && !stopped){
+    if (buckets[topBucket].empty()){
+      topBucket--;
+      if (topBucket >= 0)
+        stopped = queryDecided(rewardTable, transTable, currValues, ldexp(targetPrecision, topBucket + 1));
+      continue;
+    }
+    if (queryState >= 0 && queryBudget > 0 && backups >= queryBudget){
+      stopped = queryDecided(rewardTable, transTable, currValues, ldexp(targetPrecision, topBucket + 1));
+      continue;
+    }
+    long i = buckets[topBucket].back();
+    buckets[topBucket].pop_back();
+    // Skip outdated queue entries.
+    if (queuedBucket[i] != topBucket)
+      continue;
+    queuedBucket[i] = -1;
+
+    long bestAction;
+    double bestValue = backup(i, rewardTable, transTable, currValues, bestAction);
+    backups++;
+    double delta = fabs(bestValue - currValues[i]);
+    currValues[i] = bestValue;
+    actions[i] = bestAction;
+    priority[i] = 0;
+
+    if (delta != 0)
+      raisePredecessors(i, delta, targetPrecision, topBucket);
+  }
+
+  iterations = (backups + numStates - 1) / numStates;
+  // No bound exceeds targetPrecision once the queue is empty. Otherwise the
+  // queued states keep their bounds for the next re-solve.
+  residual = stopped ? ldexp(targetPrecision, topBucket + 1) : targetPrecision;
+  boundsAboveTarget = stopped;
+}
+
+void ValueIteration::enqueue(long state, double targetPrecision, long& topBucket)
+{
+  int exponent;
+  frexp(priority[state] / targetPrecision, &exponent);
+  long bucket = exponent - 1;
+  if (bucket <= queuedBucket[state])
+    return;
+  if (bucket >= static_cast<long>(buckets.size()))
+    buckets.resize(bucket + 1);
+  buckets[bucket].push_back(state);
+  queuedBucket[state] = bucket;
+  if (bucket > topBucket)
+    topBucket = bucket;
+}
+
+void ValueIteration::buildPredecessors(const TransitionTable& transTable, const vector<long>* changedStates)
+{
+  long built = static_cast<long>(predecessorOffsets.size()) - 1;
+  if (predecessorTable == &transTable && predecessorVersion == transTable.Version()
+      && built == numStates)
+    return;
+
+  // Since the last solve only the entries of changedStates changed, so if
+  // the lists were up to date then, replace the entries of those states.
+  if (changedStates && predecessorTable == &transTable && solvedTable == &transTable
+      && predecessorVersion == solvedVersion && built >= 0 && built <= numStates
+      && addedPredecessors.size() <= predecessors.size()){
+    // States added since have no entries in the full build.
+    predecessorOffsets.resize(numStates + 1, predecessorOffsets[built]);
+    predecessorSlotOffsets.resize(numStates + 1, predecessorSlotOffsets[built]);
+    addedHead.resize(numStates, -1);
+    addedSourceHead.resize(numStates, -1);
+    for (unsigned long n = 0; n < changedStates->size(); n++){
+      long i = (*changedStates)[n];
+      for (long k = predecessorSlotOffsets[i]; k < predecessorSlotOffsets[i + 1]; k++)
+        predecessorProbs[predecessorSlots[k]] = 0;
+      for (long e = addedSourceHead[i]; e >= 0; e = addedSourceNext[e])
+        addedProbs[e] = 0;
+      addedSourceHead[i] = -1;
+      for (long j = 0; j < numActions; j++){
+        for (long k = transTable.Begin(i, j); k < transTable.End(i, j); k++){
+          long next = transTable.NextState(k);
+          long e = addedPredecessors.size();
+          addedPredecessors.push_back(i);
+          addedProbs.push_back(transTable.Probability(k));
+          addedNext.push_back(addedHead[next]);
+          addedHead[next] = e;
+          addedSourceNext.push_back(addedSourceHead[i]);
+          addedSourceHead[i] = e;
+        }
+      }
+    }
+    predecessorVersion = transTable.Version();
+    return;
+  }
+  predecessorTable = &transTable;
+  predecessorVersion = transTable.Version();
+
+  // Counting sort of all entries by next state.
+  predecessorOffsets.assign(numStates + 1, 0);
+  for (long i = 0; i < numStates; i++){
+    for (long j = 0; j < numActions; j++){
+      for (long k = transTable.Begin(i, j); k < transTable.End(i, j); k++)
+        predecessorOffsets[transTable.NextState(k) + 1]++;
+    }
+  }
+  for (long i = 0; i < numStates; i++)
+    predecessorOffsets[i + 1] += predecessorOffsets[i];
+
+  predecessors.resize(predecessorOffsets[numStates]);
+  predecessorProbs.resize(predecessorOffsets[numStates]);
+  predecessorSlotOffsets.resize(numStates + 1);
+  predecessorSlots.resize(predecessorOffsets[numStates]);
+  predecessorFill.assign(predecessorOffsets.begin(), predecessorOffsets.end() - 1);
+  long slot = 0;
+  for (long i = 0; i < numStates; i++){
+    predecessorSlotOffsets[i] = slot;
+    for (long j = 0; j < numActions; j++){
+      for (long k = transTable.Begin(i, j); k < transTable.End(i, j); k++){
+        long next = transTable.NextState(k);
+        predecessors[predecessorFill[next]] = i;
+        predecessorProbs[predecessorFill[next]] = transTable.Probability(k);
+        predecessorSlots[slot++] = predecessorFill[next];
+        predecessorFill[next]++;
+      }
+    }
+  }
+  predecessorSlotOffsets[numStates] = slot;
+
+  addedHead.assign(numStates, -1);
+  addedSourceHead.assign(numStates, -1);
+  addedNext.resize(0);
+  addedSourceNext.resize(0);
+  addedPredecessors.resize(0);
+  addedProbs.resize(0);
+}
+
+void ValueIteration::raisePredecessors(long state, double delta, double targetPrecision, long& topBucket)
+{
+  for (long k = predecessorOffsets[state]; k < predecessorOffsets[state + 1]; k++){
+    long pred = predecessors[k];
+    priority[pred] += discount * predecessorProbs[k] * delta;
+    if (priority[pred] > targetPrecision)
+      enqueue(pred, targetPrecision, topBucket);
+  }
+  for (long k = addedHead[state]; k >= 0; k = addedNext[k]){
+    long pred = addedPredecessors[k];
+    priority[pred] += discount * addedProbs[k] * delta;
+    if (priority[pred] > targetPrecision)
+      enqueue(pred, targetPrecision, topBucket);
+  }
+}
+
+double ValueIteration::backup(long state, const RewardTable& rewardTable, const TransitionTable& transTable, const vector<double>& oldValues, long& bestAction)
+{
+  double bestValue = -FLT_MAX;
+  bestAction = 0;
+
+  for (long j = 0; j < numActions; j++){
+
+    // Action j is not available for this state
+    if (!actionApplicable[state * numActions + j])
+      continue;
+
+    // Compute discounted reward
+    double currValue = rewardTable.Get(state, j);
+    long end = transTable.End(state, j);
+    if (backupModel && transTable.Begin(state, j) == end)
+      currValue += discount * backupModel->ExpectedValue(state, j, oldValues);
+    for (long k = transTable.Begin(state, j); k < end; k++){
+      long nextState = transTable.NextState(k);
+      double prob = transTable.Probability(k);
+      currValue +=  discount * prob * oldValues[nextState];
+    }
+
+    // Seach for best discounted rewards among all actions in this state
+    if (currValue > bestValue){
+      bestValue = currValue;
+      bestAction = j;
+    }
+  }
+  return bestValue;
+}
+
+double ValueIteration::sweep(const RewardTable& rewardTable, const TransitionTable& transTable, long begin, long end, const vector<double>& oldValues, vector<double>& newValues)
+{
+  double change = 0;
+  for (long i = begin; i < end; i++){
+    long bestAction;
+    newValues[i] = backup(i, rewardTable, transTable, oldValues, bestAction);
+    actions[i] = bestAction;
+    if (fabs(newValues[i] - oldValues[i]) > change)
+      change = fabs(newValues[i] - oldValues[i]);
+  }
+  return change;
+}
+
+void ValueIteration::setNumThreads(int numThreads)
+{
+  if (numThreads <= 1)
+    threadPool.reset();
+  else
+    threadPool = make_shared<ThreadPool>(numThreads);
+}
+
+int ValueIteration::getNumThreads() const
+{
+  return threadPool ? threadPool->NumThreads() : 1;
+}
+
+void ValueIteration::addStates(long count, double initialValue)
+{
+  numStates += count;
+  values.resize(numStates, initialValue);
+  actions.resize(numStates, 0);
+  actionApplicable.resize(numStates * numActions, true);
+  // The new states are not solved yet, and get seeded when re-solving.
+  if (!priority.empty())
+    priority.resize(numStates, 0);
+}
+
+void ValueIteration::setSolution(const vector<double>& values, const vector<int>& actions, const vector<double>& residualBounds)
+{
+  this->values = values;
+  this->actions = actions;
+  clearTrialChanges();
+  // The old bounds belong to the old values.
+  if (static_cast<long>(residualBounds.size()) == numStates)
+    priority = residualBounds;
+  else
+    priority.assign(numStates, 0);
+  boundsAboveTarget = true;
+  // The predecessor lists cannot tell what changed since.
+  solvedTable = 0;
+}
+
+void ValueIteration::clearTrialChanges()
+{
+  for (unsigned long n = 0; n < trialStates.size(); n++)
+    trialChanges[trialStates[n]] = 0;
+  trialStates.resize(0);
+}
+
 void ValueIteration::write(std::string filename)
 {
   ofstream fp;
@@ -3,6 +3,12 @@
 
 #include <vector>
 #include <string>
+#include <limits>
+#include <memory>
+#include <random>
+#include "RewardTable.h"
+#include "ThreadPool.h"
+#include "TransitionTable.h"
 
 /**
    @class ValueIteration
@@ -17,24 +23,141 @@
 
 using namespace std;
 
+// A transition model computing expected next values on the fly, for the
+// (state, action) pairs whose entries are not stored in the table.
+class BackupModel
+{
+ public:
+  virtual ~BackupModel() {}
+  // Expected value of \a values at the next state of (state, action).
+  // May be called from several threads at once.
+  virtual double ExpectedValue(long state, long action, const vector<double>& values) const = 0;
+};
+
 class ValueIteration
 {
  public:
+  /**
+     JACOBI backs up every state from the values of the previous sweep.
+     GAUSS_SEIDEL backs up every state in place, using the newest values.
+     PRIORITIZED_SWEEPING backs up the state with the largest bound on its
+     Bellman residual first, and stops when no bound exceeds the target.
+     Only JACOBI uses the threads given by setNumThreads.
+  */
+  enum Solver {JACOBI, GAUSS_SEIDEL, PRIORITIZED_SWEEPING};
+
   ValueIteration(long numStates, long numActions, double discount, vector<double>& values):
-      values(values), numStates(numStates), numActions(numActions), discount(discount) {
-    actionApplicable.resize(numStates);
-    for (int i = 0; i < numStates; ++i)
-      actionApplicable[i].resize(numActions, true);
+       values(values), numStates(numStates), numActions(numActions), discount(discount), solver(JACOBI), backups(0), iterations(0), residual(0), minValue(-numeric_limits<double>::infinity()), maxValue(numeric_limits<double>::infinity()), queryState(-1), queryAction(0), queryBudget(0), queryProven(false), queryStopped(false), boundsAboveTarget(false), predecessorTable(0), predecessorVersion(0), solvedTable(0), solvedVersion(0), backupModel(0) {
+    actionApplicable.resize(numStates * numActions, true);
   };
 
-  ValueIteration(long numStates, long numActions, double discount, const vector<vector<bool> >& actionApplicable, vector<double>& values):
-     values(values), numStates(numStates), numActions(numActions), discount(discount), actionApplicable(actionApplicable) {};
+  // actionApplicable holds whether action a is available at state s at
+  // s * numActions + a.
+  ValueIteration(long numStates, long numActions, double discount, const vector<bool>& actionApplicable, vector<double>& values):
+     values(values), numStates(numStates), numActions(numActions), discount(discount), actionApplicable(actionApplicable), solver(JACOBI), backups(0), iterations(0), residual(0), minValue(-numeric_limits<double>::infinity()), maxValue(numeric_limits<double>::infinity()), queryState(-1), queryAction(0), queryBudget(0), queryProven(false), queryStopped(false), boundsAboveTarget(false), predecessorTable(0), predecessorVersion(0), solvedTable(0), solvedVersion(0), backupModel(0) {};
+
+    /**
+       Splits every sweep of doValueIteration over \a numThreads threads.
+       The result is identical to the single threaded solver. 1 by default.
+    */
+    void setNumThreads(int numThreads);
+    // Same, with threads shared with other users of pool. Empty for 1 thread.
+    void setThreadPool(shared_ptr<ThreadPool> pool) {threadPool = pool;};
+    int getNumThreads() const;
+
+    /**
+       Backs up the (state, action) pairs without entries in the table
+       through \a model instead of as absorbing. Prioritized sweeping needs
+       the predecessors in the table, so with a model re-solves and
+       PRIORITIZED_SWEEPING run Gauss-Seidel sweeps from the current values,
+       and RTDP trials end at such pairs. Null by default.
+    */
+    void setBackupModel(const BackupModel* model) {backupModel = model;};
+
+    // Selects the solver used by doValueIteration. JACOBI by default.
+    void setSolver(Solver solver) {this->solver = solver;};
+    Solver getSolver() const {return solver;};
+
+    // Number of state backups performed by the last doValueIteration.
+    long getBackups() const {return backups;};
+    // Number of sweeps of the last doValueIteration. Prioritized sweeping
+    // counts one per numStates backups, rounded up.
+    long getIterations() const {return iterations;};
+    // Upper bound on the Bellman residual left by the last doValueIteration.
+    double getResidual() const {return residual;};
+
+    /**
+       Every reward lies in [\a minReward, \a maxReward], so every value lies
+       within the same range divided by 1 - discount. Tightens the bounds of
+       solveForAction. Unbounded by default.
+    */
+    void setRewardBounds(double minReward, double maxReward);
+
+    void doValueIteration(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long displayInterval = 100);
 
+    /**
+       Re-solves after the model of \a changedStates changed, starting from the
+       current values. The values must have been solved for the old model, and
+       changedStates must hold every state whose entries in transTable changed
+       since, as the predecessor lists are only updated for those.
+       Only states reachable backwards from changedStates are backed up, in
+       prioritized sweeping order, whatever solver is selected.
+    */
+    void doValueIteration(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, const vector<long>& changedStates);
 
+    /**
+       Anytime planning from \a startState by real-time dynamic programming:
+       every trial backs up the states along a path sampled from the greedy
+       actions, from the current values, for at most the horizon beyond which
+       discounting makes changes smaller than \a targetPrecision. Stops when
+       \a maxSeconds of wall-clock time or \a maxBackups backups are spent,
+       0 meaning no limit, or when a trial changes no value by more than
+       \a targetPrecision. Returns the greedy action of startState.
+       getIterations counts the trials. A later re-solve accounts for the
+       values changed here.
+    */
+    long doRTDP(const RewardTable& rewardTable, const TransitionTable& transTable, long startState, double targetPrecision, double maxSeconds, long maxBackups = 0);
+
+    /**
+       Solves with the selected solver, or re-solves from \a changedStates as
+       the doValueIteration taking them does, but only until the best action
+       of \a queryState is certain. The values are within r / (1 - discount)
+       of the optimal ones when r bounds their Bellman residual, which gives
+       bounds on the action values of queryState. The solve stops as soon as
+       the lower bound of the greedy action exceeds the upper bounds of all
+       others, or once \a maxBackups backups are spent (0 for no limit), or
+       at \a targetPrecision. Sets \a bestAction to the greedy action of
+       queryState and returns true if it is proven optimal. Values left above
+       targetPrecision are backed up again by the next re-solve.
+    */
+    bool solveForAction(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long queryState, long& bestAction, long maxBackups = 0, const vector<long>* changedStates = 0);
+    // True if some state may need backups to reach the precision of the
+    // last solve even without changes, e.g. after solveForAction stopped early.
+    bool hasPendingBackups() const {return boundsAboveTarget;};
+
+    // The best action of \a state given the current values.
+    long greedyAction(long state, const RewardTable& rewardTable, const TransitionTable& transTable);
+
+    // Packs the nested reward and transition matrices into tables first.
     void doValueIteration(std::vector<std::vector<double> >& rewardMatrix, std::vector<std::vector<std::vector<std::pair<long,double> > > >& transMatrix, double targetPrecision, long displayInterval = 100);
     
     std::vector<double> values;
     std::vector<int> actions;
+
+    /**
+       Adds \a count states after the existing ones, with \a initialValue and
+       every action applicable. The transition table must cover them.
+    */
+    void addStates(long count, double initialValue);
+
+    /**
+       Replaces the values and actions, e.g. by a solution restored from a
+       checkpoint, with the bounds on their residuals from getResidualBounds.
+       Without bounds a later re-solve treats the values as converged.
+    */
+    void setSolution(const vector<double>& values, const vector<int>& actions, const vector<double>& residualBounds);
+    // Bounds on the Bellman residuals kept for re-solving, empty if unknown.
+    const vector<double>& getResidualBounds() const {return priority;};
     
     /** 
       Write out the policy \a filename
@@ -50,8 +173,111 @@ class ValueIteration
     long numStates;
     long numActions;
     double discount;
-    vector<vector<bool> > actionApplicable;
+    vector<bool> actionApplicable;
+    Solver solver;
+    long backups;
+    long iterations;
+    double residual;
+    // Range of the values given by setRewardBounds.
+    double minValue;
+    double maxValue;
+
+    // State of solveForAction, queryState is -1 otherwise.
+    long queryState;
+    long queryAction;
+    long queryBudget;
+    bool queryProven;
+    // Set when the solver loop stopped before targetPrecision.
+    bool queryStopped;
+    // Bounds the action values of queryState from the values in current,
+    // whose Bellman residual is at most residualBound. Returns true if the
+    // solver should stop, i.e. the action is proven or the budget is spent.
+    bool queryDecided(const RewardTable& rewardTable, const TransitionTable& transTable, const vector<double>& current, double residualBound);
+    vector<double> queryLow;
+    vector<double> queryHigh;
+    // True if some bound in priority may exceed the precision of the last
+    // solve outside of the states a re-solve seeds, after a solve stopped
+    // early or a restored solution.
+    bool boundsAboveTarget;
+
+    void doJacobi(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, long displayInterval);
+    void doGaussSeidel(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision);
+    // Seeds the queue with every state, or only with seeds when given.
+    void doPrioritizedSweeping(const RewardTable& rewardTable, const TransitionTable& transTable, double targetPrecision, const vector<long>* seeds);
+    // Brings the predecessor lists up to date with transTable. After a solve
+    // on the table the lists were built from, only the entries of
+    // changedStates are replaced, otherwise the lists are built again.
+    void buildPredecessors(const TransitionTable& transTable, const vector<long>* changedStates);
+    // Raises the bounds of the predecessors of state after its value changed
+    // by delta, and queues those above targetPrecision.
+    void raisePredecessors(long state, double delta, double targetPrecision, long& topBucket);
+
+    // Bellman backup of one state against oldValues. Returns the best value.
+    double backup(long state, const RewardTable& rewardTable, const TransitionTable& transTable, const vector<double>& oldValues, long& bestAction);
+    // Backs up states [begin, end) into newValues, returns the largest change.
+    double sweep(const RewardTable& rewardTable, const TransitionTable& transTable, long begin, long end, const vector<double>& oldValues, vector<double>& newValues);
+
+    // Kept across calls so that repeated solves do not reallocate.
+    vector<vector<double> > tempValues;
+
+    // Workers of the parallel sweeps. Empty when running single threaded.
+    shared_ptr<ThreadPool> threadPool;
+    // Number of states per parallel chunk, and the largest change of each chunk.
+    static const long sweepGrain = 1024;
+    vector<double> chunkChanges;
+
+    // Reverse transitions of prioritized sweeping: the predecessors of state s
+    // are predecessors[predecessorOffsets[s] .. predecessorOffsets[s+1]), each
+    // with the probability of reaching s, as of the last full build. The
+    // entries of s as a predecessor are at the positions
+    // predecessorSlots[predecessorSlotOffsets[s] .. predecessorSlotOffsets[s+1]).
+    vector<long> predecessorOffsets;
+    vector<long> predecessors;
+    vector<double> predecessorProbs;
+    vector<long> predecessorSlotOffsets;
+    vector<long> predecessorSlots;
+    // Next free slot of every state while filling, kept to reuse its memory.
+    vector<long> predecessorFill;
+    // Entries of the states changed since the full build, whose old entries
+    // have probability 0. They are linked into a list per next state from
+    // addedHead through addedNext, and into a list per predecessor from
+    // addedSourceHead through addedSourceNext, -1 ending both. The lists are
+    // built again once they hold more entries than the full build.
+    vector<long> addedHead;
+    vector<long> addedNext;
+    vector<long> addedSourceHead;
+    vector<long> addedSourceNext;
+    vector<long> addedPredecessors;
+    vector<double> addedProbs;
+    // The table and version the predecessor lists were built from.
+    const TransitionTable* predecessorTable;
+    long predecessorVersion;
+    // The table and version of the last solve, null when the values come
+    // from elsewhere.
+    const TransitionTable* solvedTable;
+    long solvedVersion;
+    // Upper bound on the Bellman residual of every state for the current
+    // values. Kept across calls for re-solving after a change.
+    vector<double> priority;
+    // Bucket queue of prioritized sweeping, and the bucket each state is
+    // queued in (-1 when it is not queued).
+    vector<vector<long> > buckets;
+    vector<long> queuedBucket;
+    void enqueue(long state, double targetPrecision, long& topBucket);
+
+    // Total change doRTDP made to the value of every state since the last
+    // solve, and the states with a nonzero change. A re-solve raises the
+    // bounds of their predecessors accordingly.
+    vector<double> trialChanges;
+    vector<long> trialStates;
+    void clearTrialChanges();
+    // Samples the successors of trials.
+    mt19937 trialRandom;
 
+    // Only used by the nested matrix version of doValueIteration.
+    RewardTable packedRewards;
+    TransitionTable packedTransitions;
+    const BackupModel* backupModel;
 };
 
 #endif // __VALUEITERATION_H
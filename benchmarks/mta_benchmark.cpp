@@ -0,0 +1,344 @@
+// Times the phases of the learner on a synthetic multi-task problem and
+// prints the results as one JSON object, for tracking regressions. Every
+// phase also reports its heap allocations, counted by replacing the global
+// operator new, array and aligned forms included. Those of the steps leave
+// out the synthetic model's Step and GenerateRewardFunction.
+//
+// Build from the repository root with
+//   g++ -std=c++11 -O2 -pthread -I. benchmarks/mta_benchmark.cpp
+//       benchmarks/synthetic_mta.cpp mta.cpp task.cpp Utility.cpp
+//       ValueIteration.cc RewardTable.cc TransitionTable.cc ThreadPool.cc
+//       StateCodec.cpp Checkpoint.cpp Metrics.cpp StateIndex.cpp
+//       ExperienceBuffer.cpp DecisionDiagram.cc -o mta_benchmark
+// Usage: mta_benchmark [name=value ...]
+// with the fields of SyntheticConfig (features, feature_size, tasks,
+// features_per_task, overlap, actions, actions_per_task, fsa, sparse, noise,
+// exploration_threshold, seed) and
+//   observations  random transitions fed before construction (10000)
+//   batch         1 to feed them with UpdateWithNewObservations (0)
+//   writers       feed them from this many threads through experience
+//                 buffers merged once at the end, 0 for none (0)
+//   steps         end to end SelectBestAction steps (300)
+//   threads       threads of every task (1)
+//   metrics       1 to enable the task metrics and print them (0)
+//   budget_seconds, budget_backups
+//                 select actions with SelectBestActionWithin under this
+//                 budget instead of solving to convergence (0, 0)
+//   action_gap    1 to stop solving once the selected action is proven (0)
+//   factored      1 to plan every task with structured value iteration over
+//                 decision diagrams; use with sparse=1 (0)
+//   matrix_free   1 to compute the backups of dense tasks from the cdtb
+//                 instead of storing their transitions (0)
+//   incremental   0 to solve every step by a full value iteration (1)
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include "synthetic_mta.h"
+
+using namespace std;
+
+// Heap allocations of the whole process so far.
+static atomic<long> allocations(0);
+
+// Every replaceable allocation function the standard in use declares counts,
+// and every deallocation function matching one frees.
+void* operator new(size_t size) {
+  allocations++;
+  if (void* memory = malloc(size ? size : 1))
+    return memory;
+  throw bad_alloc();
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+  free(memory);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* memory, size_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+  free(memory);
+}
+#endif
+
+#ifdef __cpp_aligned_new
+void* operator new(size_t size, align_val_t alignment) {
+  allocations++;
+  // aligned_alloc wants a nonzero multiple of the alignment.
+  size_t align = static_cast<size_t>(alignment);
+  if (void* memory = aligned_alloc(align, size ? (size + align - 1) / align * align : align))
+    return memory;
+  throw bad_alloc();
+}
+
+void* operator new[](size_t size, align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void operator delete(void* memory, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete(void* memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+
+void operator delete[](void* memory, size_t, align_val_t) noexcept {
+  free(memory);
+}
+#endif
+
+namespace {
+
+double Since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Prints one phase: its run time, how many items it processed, the rate and
+// the heap allocations per item.
+void PrintPhase(const char* name, double seconds, long count, long allocated,
+    bool last = false) {
+  printf("    \"%s\": {\"seconds\": %.6f, \"count\": %ld, \"per_second\": %.1f, "
+      "\"allocations\": %ld, \"allocations_per_item\": %.3f}%s\n",
+      name, seconds, count, seconds > 0 ? count / seconds : 0.0, allocated,
+      count > 0 ? double(allocated) / count : 0.0, last ? "" : ",");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  SyntheticConfig config;
+  long observations = 10000;
+  long steps = 300;
+  int threads = 1;
+  bool metrics = false;
+  double budget_seconds = 0;
+  long budget_backups = 0;
+  bool action_gap = false;
+  bool factored = false;
+  bool matrix_free = false;
+  bool incremental = true;
+  bool batch = false;
+  int writers = 0;
+  for (int i = 1; i < argc; ++i) {
+    const char* value = strchr(argv[i], '=');
+    if (!value) {
+      fprintf(stderr, "Expected name=value, got %s\n", argv[i]);
+      return 1;
+    }
+    string name(argv[i], value - argv[i]);
+    ++value;
+    if (name == "features") config.features = atoi(value);
+    else if (name == "feature_size") config.feature_size = atoi(value);
+    else if (name == "tasks") config.tasks = atoi(value);
+    else if (name == "features_per_task") config.features_per_task = atoi(value);
+    else if (name == "overlap") config.overlap = atof(value);
+    else if (name == "actions") config.actions = atoi(value);
+    else if (name == "actions_per_task") config.actions_per_task = atoi(value);
+    else if (name == "fsa") config.fsa = atoi(value) != 0;
+    else if (name == "sparse") config.sparse = atoi(value) != 0;
+    else if (name == "noise") config.noise = atof(value);
+    else if (name == "exploration_threshold") config.exploration_threshold = atoi(value);
+    else if (name == "seed") config.seed = atoi(value);
+    else if (name == "observations") observations = atol(value);
+    else if (name == "batch") batch = atoi(value) != 0;
+    else if (name == "writers") writers = atoi(value);
+    else if (name == "steps") steps = atol(value);
+    else if (name == "threads") threads = atoi(value);
+    else if (name == "metrics") metrics = atoi(value) != 0;
+    else if (name == "budget_seconds") budget_seconds = atof(value);
+    else if (name == "budget_backups") budget_backups = atol(value);
+    else if (name == "action_gap") action_gap = atoi(value) != 0;
+    else if (name == "factored") factored = atoi(value) != 0;
+    else if (name == "matrix_free") matrix_free = atoi(value) != 0;
+    else if (name == "incremental") incremental = atoi(value) != 0;
+    else {
+      fprintf(stderr, "Unknown parameter %s\n", name.c_str());
+      return 1;
+    }
+  }
+
+  SyntheticMTA mta(config);
+  mta.InitializeTasks();
+  mta.ComputeComponents();
+  if (config.fsa)
+    mta.UseFSA();
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  long allocated = allocations;
+  mta.GenerateContextualDependencyTable();
+  double cdtb_seconds = Since(start);
+  long cdtb_allocations = allocations - allocated;
+  long cells = 0;
+  for (unsigned int k = 0; k < mta.cdtb.size(); ++k)
+    cells += mta.cdtb[k].size();
+  if (threads > 1)
+    mta.SetNumThreads(threads);
+  for (auto i : mta.tasks) {
+    i.second->action_gap_termination = action_gap;
+    i.second->matrix_free = matrix_free;
+    i.second->incremental_planning = incremental;
+    if (factored)
+      mta.UseFactoredPlanning(i.second);
+  }
+  mta.EnableMetrics(metrics);
+
+  // Random transitions from random states.
+  vector<vector<int> > from(observations), to(observations);
+  vector<int> actions(observations);
+  for (long i = 0; i < observations; ++i) {
+    from[i] = mta.RandomState();
+    actions[i] = mta.RandomAction();
+    to[i] = mta.Step(from[i], actions[i]);
+  }
+  vector<int> packed;
+  if (batch) {
+    for (long i = 0; i < observations; ++i) {
+      packed.insert(packed.end(), from[i].begin(), from[i].end());
+      packed.push_back(actions[i]);
+      packed.insert(packed.end(), to[i].begin(), to[i].end());
+    }
+  }
+  start = chrono::steady_clock::now();
+  allocated = allocations;
+  if (writers > 0) {
+    vector<thread> threads;
+    for (int w = 0; w < writers; ++w) {
+      shared_ptr<ExperienceBuffer> buffer = mta.NewExperienceBuffer();
+      threads.push_back(thread([&, w, buffer] {
+        for (long i = w; i < observations; i += writers)
+          buffer->Append(from[i], actions[i], to[i]);
+      }));
+    }
+    for (int w = 0; w < writers; ++w)
+      threads[w].join();
+    mta.MergeExperience();
+  } else if (batch) {
+    mta.UpdateWithNewObservations(packed.data(), observations);
+  } else {
+    for (long i = 0; i < observations; ++i)
+      mta.UpdateWithNewObservation(from[i], actions[i], to[i], 0);
+  }
+  double update_seconds = Since(start);
+  long update_allocations = allocations - allocated;
+
+  // Sparse tasks grow from the start state.
+  vector<int> state = mta.RandomState();
+  start = chrono::steady_clock::now();
+  allocated = allocations;
+  long entries = 0;
+  for (auto i : mta.tasks) {
+    i.second->AddState(state);
+    i.second->ConstructTransitionFunction();
+    entries += i.second->transition.NumEntries();
+  }
+  double construct_seconds = Since(start);
+  long construct_allocations = allocations - allocated;
+
+  long backups = 0;
+  double vi_seconds = 0;
+  long vi_allocations = 0;
+  for (auto i : mta.tasks) {
+    Task* task = i.second;
+    mta.GenerateRewardFunction(task);
+    start = chrono::steady_clock::now();
+    allocated = allocations;
+    // A factored solve counts the diagram nodes it builds instead.
+    if (factored) {
+      backups += task->Solve();
+    } else {
+      task->vi->doValueIteration(task->reward, task->transition, 0.1);
+      backups += task->vi->getBackups();
+    }
+    vi_allocations += allocations - allocated;
+    vi_seconds += Since(start);
+  }
+
+  // The usual learning loop, round robin over the tasks.
+  bool anytime = budget_seconds > 0 || budget_backups > 0;
+  long step_allocations = 0;
+  start = chrono::steady_clock::now();
+  for (long t = 0; t < steps; ++t) {
+    Task* task = mta.tasks[mta.task_names[t % mta.task_names.size()]];
+    allocated = allocations;
+    task->RefreshTransitions();
+    step_allocations += allocations - allocated;
+    mta.GenerateRewardFunction(task);
+    allocated = allocations;
+    int action = anytime ?
+        task->SelectBestActionWithin(state, budget_seconds, budget_backups) :
+        task->SelectBestAction(state);
+    step_allocations += allocations - allocated;
+    vector<int> next = mta.Step(state, action);
+    allocated = allocations;
+    mta.UpdateWithNewObservation(state, action, next, 0);
+    step_allocations += allocations - allocated;
+    state = next;
+  }
+  double step_seconds = Since(start);
+
+  // Held states, which a sparse task only finds while learning.
+  long states = 0;
+  long transition_bytes = 0;
+  long value_nodes = 0;
+  for (auto i : mta.tasks) {
+    states += i.second->NumIndexedStates() - 1;
+    transition_bytes += i.second->transition.MemoryBytes();
+    value_nodes += i.second->FactoredNodes();
+  }
+
+  printf("{\n  \"config\": {\"features\": %d, \"feature_size\": %d, \"tasks\": %d, "
+      "\"features_per_task\": %d, \"overlap\": %g, \"actions\": %d, "
+      "\"actions_per_task\": %d, \"fsa\": %s, \"sparse\": %s, \"noise\": %g, "
+      "\"exploration_threshold\": %d, \"seed\": %u, \"observations\": %ld, "
+      "\"batch\": %s, \"writers\": %d, \"steps\": %ld, \"threads\": %d, \"metrics\": %s, "
+      "\"budget_seconds\": %g, \"budget_backups\": %ld, \"action_gap\": %s, "
+      "\"factored\": %s, \"matrix_free\": %s, \"incremental\": %s},\n",
+      config.features, config.feature_size, config.tasks,
+      config.features_per_task, config.overlap, config.actions,
+      config.actions_per_task, config.fsa ? "true" : "false",
+      config.sparse ? "true" : "false", config.noise,
+      config.exploration_threshold, config.seed, observations,
+      batch ? "true" : "false", writers, steps, threads,
+      metrics ? "true" : "false", budget_seconds, budget_backups,
+      action_gap ? "true" : "false", factored ? "true" : "false",
+      matrix_free ? "true" : "false", incremental ? "true" : "false");
+  printf("  \"problem\": {\"components\": %d, \"cdtb_cells\": %ld, "
+      "\"task_states\": %ld, \"transition_entries\": %ld, "
+      "\"transition_bytes\": %ld, \"value_nodes\": %ld},\n",
+      int(mta.components.size()), cells, states, entries, transition_bytes,
+      value_nodes);
+  printf("  \"phases\": {\n");
+  PrintPhase("generate_contextual_dependency_table", cdtb_seconds, cells,
+      cdtb_allocations);
+  PrintPhase("update_with_new_experience", update_seconds, observations,
+      update_allocations);
+  PrintPhase("construct_transition_function", construct_seconds, entries,
+      construct_allocations);
+  PrintPhase("value_iteration", vi_seconds, backups, vi_allocations);
+  PrintPhase("select_best_action_step", step_seconds, steps, step_allocations, true);
+  if (metrics)
+    printf("  },\n  \"metrics\": %s\n}\n", mta.MetricsJson().c_str());
+  else
+    printf("  }\n}\n");
+  return 0;
+}
@@ -0,0 +1,126 @@
+#include "synthetic_mta.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+SyntheticMTA::SyntheticMTA(const SyntheticConfig& config):
+    config(config), rng(config.seed) {
+}
+
+SyntheticMTA::~SyntheticMTA() {
+  // The planner must not outlive the tasks.
+  StopBackgroundPlanner();
+  for (auto i : tasks)
+    delete i.second;
+}
+
+void SyntheticMTA::Setup() {
+  InitializeTasks();
+  ComputeComponents();
+  if (config.fsa)
+    UseFSA();
+  GenerateContextualDependencyTable();
+}
+
+void SyntheticMTA::InitializeTasks() {
+  feature_size.assign(config.features, config.feature_size);
+  total_actions = config.actions;
+  exploration_threshold = config.exploration_threshold;
+
+  int feature_step = max(1, int(lround(config.features_per_task * (1 - config.overlap))));
+  int action_step = max(1, int(lround(config.actions_per_task * (1 - config.overlap))));
+  moves.assign(config.features * config.actions, false);
+  for (int i = 0; i < config.tasks; ++i) {
+    vector<bool> task_features(config.features, false);
+    vector<bool> task_actions(config.actions, false);
+    for (int j = 0; j < config.features_per_task; ++j)
+      task_features[(i * feature_step + j) % config.features] = true;
+    for (int a = 0; a < config.actions_per_task; ++a)
+      task_actions[(i * action_step + a) % config.actions] = true;
+    for (int j = 0; j < config.features; ++j)
+      for (int a = 0; a < config.actions; ++a)
+        if (task_features[j] && task_actions[a])
+          moves[j * config.actions + a] = true;
+
+    ostringstream name;
+    name << "task" << i;
+    task_names.push_back(name.str());
+    tasks[name.str()] = new Task(task_features, task_actions, name.str(),
+        feature_size, 1, config.sparse);
+  }
+
+  target.resize(config.features * (config.actions + 1) * config.feature_size);
+  for (unsigned int i = 0; i < target.size(); ++i)
+    target[i] = rng() % config.feature_size;
+}
+
+vector<bool> SyntheticMTA::RewardFeatures(const Task* some_task) const {
+  vector<bool> reward_features(config.features, false);
+  int goal_feature = 0;
+  while (!some_task->features[goal_feature])
+    ++goal_feature;
+  reward_features[goal_feature] = true;
+  return reward_features;
+}
+
+void SyntheticMTA::UseFactoredPlanning(Task* some_task) {
+  vector<bool> reward_features = RewardFeatures(some_task);
+  int goal_feature = find(reward_features.begin(), reward_features.end(), true) -
+      reward_features.begin();
+  int goal_value = config.feature_size - 1;
+  some_task->factored = true;
+  some_task->SetFactoredReward(reward_features,
+      [goal_feature, goal_value](const vector<int>& state, int) {
+        return state[goal_feature] == goal_value ? 1.0 : 0.0;
+      });
+}
+
+void SyntheticMTA::GenerateRewardFunction(Task* some_task) {
+  int goal_feature = 0;
+  while (!some_task->features[goal_feature])
+    ++goal_feature;
+  vector<int> state(feature_size.size(), -1);
+  for (int s = 0; s < some_task->NumIndexedStates(); ++s) {
+    if (s == some_task->fictitious_state)
+      continue;
+    some_task->DecodeState(s, state);
+    double value = state[goal_feature] == config.feature_size - 1 ? 1 : 0;
+    for (int a = 0; a < some_task->total_actions; ++a) {
+      // Transitions to the fictitious state keep their rmax reward.
+      const TransitionTable& transition = some_task->transition;
+      if (transition.Size(s, a) == 1 &&
+          transition.NextState(transition.Begin(s, a)) == some_task->fictitious_state)
+        continue;
+      some_task->reward.Set(s, a, value);
+    }
+  }
+}
+
+void SyntheticMTA::UpdateWithNewObservation(const vector<int>& last_state,
+    int action, const vector<int>& curr_state, int) {
+  // Components not moved by the action learn the no-op column.
+  for (unsigned int k = 0; k < cdtb.size(); ++k) {
+    Distribution& cell = cdtb[k][ObservationColumn(k, action)];
+    cell.UpdateWithNewExperience(last_state, curr_state, fsa);
+  }
+}
+
+vector<int> SyntheticMTA::Step(const vector<int>& state, int action) {
+  vector<int> next(state.size());
+  uniform_real_distribution<double> uniform(0, 1);
+  for (int j = 0; j < config.features; ++j) {
+    int a = moves[j * config.actions + action] ? action : config.actions;
+    if (uniform(rng) < config.noise)
+      next[j] = rng() % config.feature_size;
+    else
+      next[j] = target[(j * (config.actions + 1) + a) * config.feature_size + state[j]];
+  }
+  return next;
+}
+
+vector<int> SyntheticMTA::RandomState() {
+  vector<int> state(config.features);
+  for (int j = 0; j < config.features; ++j)
+    state[j] = rng() % config.feature_size;
+  return state;
+}
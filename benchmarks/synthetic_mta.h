@@ -0,0 +1,81 @@
+#ifndef __SYNTHETIC_MTA_H
+#define __SYNTHETIC_MTA_H
+
+#include <random>
+#include <vector>
+#include "mta.h"
+
+using namespace std;
+
+// Shape of a synthetic multi-task problem.
+struct SyntheticConfig {
+  SyntheticConfig(): features(12), feature_size(3), tasks(4),
+      features_per_task(6), overlap(0.5), actions(8), actions_per_task(4),
+      fsa(false), sparse(false), noise(0.2), exploration_threshold(3), seed(1) {}
+
+  int features;
+  // Number of values of every feature.
+  int feature_size;
+  int tasks;
+  int features_per_task;
+  // Fraction of its features a task shares with the next task, in [0, 1].
+  double overlap;
+  int actions;
+  int actions_per_task;
+  bool fsa;
+  // Tasks hold only the states they reach.
+  bool sparse;
+  // Probability that a feature moves to a uniformly random value instead of
+  // the one its ground truth dynamics select.
+  double noise;
+  int exploration_threshold;
+  unsigned int seed;
+};
+
+// An MTA instance with random ground truth dynamics, for benchmarks.
+//
+// Tasks take consecutive windows of the features and of the actions, each
+// starting where the previous one stops sharing, so task i and i + 1 share
+// about overlap * features_per_task features. Every feature moves to a
+// value chosen by a random table of its current value and the action. An
+// action moves only the features of tasks having it; the other features
+// follow the no-op dynamics, matching the MTA assumption.
+//
+// The reward of a task is 1 when its first feature holds its largest value.
+class SyntheticMTA : public MTA {
+ public:
+  explicit SyntheticMTA(const SyntheticConfig& config);
+  virtual ~SyntheticMTA();
+
+  // Initializes tasks, components and the contextual dependency table.
+  void Setup();
+
+  virtual void InitializeTasks();
+  virtual void GenerateRewardFunction(Task* some_task);
+  virtual void UpdateWithNewObservation(const vector<int>& last_state,
+      int action, const vector<int>& curr_state, int reward);
+
+  // The features GenerateRewardFunction reads for some_task.
+  vector<bool> RewardFeatures(const Task* some_task) const;
+  // Makes some_task plan with structured value iteration, over the same
+  // rewards as GenerateRewardFunction.
+  void UseFactoredPlanning(Task* some_task);
+
+  // Samples the ground truth dynamics.
+  vector<int> Step(const vector<int>& state, int action);
+  vector<int> RandomState();
+  int RandomAction() {return rng() % config.actions;};
+
+  const SyntheticConfig& Config() const {return config;};
+
+ private:
+  SyntheticConfig config;
+  mt19937 rng;
+  // target[(j * (actions + 1) + a) * feature_size + v] is the next value of
+  // feature j with value v under action a; action "actions" is the no-op.
+  vector<int> target;
+  // moves[j * actions + a] is true if action a moves feature j.
+  vector<bool> moves;
+};
+
+#endif // __SYNTHETIC_MTA_H
@@ -1,13 +1,22 @@
 #include "mta.h"
+#include <algorithm>
+#include <sstream>
 using namespace std;
 
 MTA::MTA() {
   // No synchronous arcs by default.
   // Call UseFSA for synchronous arcs.
   fsa = false;
+  experience_epoch = 0;
+  planner_stop = false;
+  plan_requested = false;
+  work_pending = false;
+  rounds_started = 0;
+  rounds_done = 0;
 }
 
 MTA::~MTA() {
+  StopBackgroundPlanner();
 }
 
 void MTA::ComputeComponents() {
@@ -39,6 +48,8 @@ void MTA::ComputeComponents() {
       components.push_back(new_component);
     }
   }
+  for (unsigned int k = 0; k < components.size(); ++k)
+    components[k].codec = StateCodec(feature_size, components[k].features);
 
   // Inform each task the components information and
   // which components are relevant.
@@ -156,10 +167,9 @@ void MTA::GenerateContextualDependencyTable() {
       }
 
       // Initializes other members of the cell.
-      cdtb[k][a].parent_size = parent_values;
-      cdtb[k][a].exploration_count.resize(parent_values, 0);
-      cdtb[k][a].distribution.resize(parent_values);
+      cdtb[k][a].Resize(parent_values);
       cdtb[k][a].component = &components[k];
+      cdtb[k][a].BuildCodecs(feature_size, fsa);
 
       // Debug
       /*
@@ -185,16 +195,193 @@ void MTA::GenerateContextualDependencyTable() {
         // Nothing extra to do for FSA if the action is no-op.
       }
     }
-    cdtb[k][total_actions].parent_size = parent_values;
-    cdtb[k][total_actions].exploration_count.resize(parent_values, 0);
-    cdtb[k][total_actions].distribution.resize(parent_values);
+    cdtb[k][total_actions].Resize(parent_values);
     cdtb[k][total_actions].component = &components[k];
+    cdtb[k][total_actions].BuildCodecs(feature_size, fsa);
 
     for (unsigned int i = 0; i < tasks.size(); ++i) {
       tasks[task_names[i]]->cdtb = &cdtb;
       tasks[task_names[i]]->exploration_threshold = exploration_threshold;
     }
   }
+
+  // The table is complete, so the tasks can resolve their cells.
+  for (unsigned int i = 0; i < tasks.size(); ++i)
+    tasks[task_names[i]]->BuildPlan();
+}
+
+int MTA::ObservationColumn(int k, int action) const {
+  return cdtb[k][action].parent_size == 0 ? total_actions : action;
+}
+
+void MTA::UpdateWithNewObservations(const int* observations, long count) {
+  int num_features = feature_size.size();
+  int stride = 2 * num_features + 1;
+  int columns = total_actions + 1;
+  int cells = cdtb.size() * columns;
+  vector<int> cell_of(cdtb.size() * total_actions);
+  for (unsigned int k = 0; k < cdtb.size(); ++k) {
+    for (int a = 0; a < total_actions; ++a) {
+      int column = ObservationColumn(k, a);
+      cell_of[k * total_actions + a] = column < 0 ? -1 : k * columns + column;
+    }
+  }
+
+  // Counting sort of the updates by cell, keeping the input order within a
+  // cell so that outcomes and versions come out as with one update at a time.
+  vector<long> offsets(cells + 1, 0);
+  for (long i = 0; i < count; ++i) {
+    int action = observations[i * stride + num_features];
+    for (unsigned int k = 0; k < cdtb.size(); ++k) {
+      int cell = cell_of[k * total_actions + action];
+      if (cell >= 0)
+        offsets[cell + 1]++;
+    }
+  }
+  for (int c = 0; c < cells; ++c)
+    offsets[c + 1] += offsets[c];
+  vector<long> order(offsets[cells]);
+  vector<long> fill(offsets.begin(), offsets.end() - 1);
+  for (long i = 0; i < count; ++i) {
+    int action = observations[i * stride + num_features];
+    for (unsigned int k = 0; k < cdtb.size(); ++k) {
+      int cell = cell_of[k * total_actions + action];
+      if (cell >= 0)
+        order[fill[cell]++] = i;
+    }
+  }
+
+  // Cells are disjoint, so each one is updated by a single thread.
+  auto update = [&](long begin, long end) {
+    for (long c = begin; c < end; ++c) {
+      Distribution& cell = cdtb[c / columns][c % columns];
+      for (long n = offsets[c]; n < offsets[c + 1]; ++n) {
+        const int* last = observations + order[n] * stride;
+        const int* curr = last + num_features + 1;
+        cell.AddExperience(fsa ? cell.parent_codec.Encode(last, curr) :
+            cell.parent_codec.Encode(last), cell.child_codec.Encode(curr));
+      }
+    }
+  };
+  if (thread_pool)
+    thread_pool->ParallelFor(cells, 1, update);
+  else
+    update(0, cells);
+}
+
+shared_ptr<ExperienceBuffer> MTA::NewExperienceBuffer() {
+  shared_ptr<ExperienceBuffer> buffer = make_shared<ExperienceBuffer>(feature_size.size(),
+      [this] {WakePlanner();});
+  lock_guard<mutex> lock(buffers_mutex);
+  experience_buffers.push_back(buffer);
+  return buffer;
+}
+
+long MTA::MergeExperience() {
+  vector<shared_ptr<ExperienceBuffer> > buffers;
+  {
+    lock_guard<mutex> lock(buffers_mutex);
+    buffers = experience_buffers;
+  }
+  long total = 0;
+  for (unsigned int i = 0; i < buffers.size(); ++i) {
+    long count = buffers[i]->Take(merged);
+    UpdateWithNewObservations(merged.data(), count);
+    total += count;
+  }
+  experience_epoch++;
+  return total;
+}
+
+void MTA::StartBackgroundPlanner() {
+  if (planner.joinable())
+    return;
+  for (auto i : tasks) {
+    i.second->request_plan = [this] {WakePlanner();};
+    i.second->use_published_policy = true;
+  }
+  planner_stop = false;
+  planner = thread(&MTA::RunPlanner, this);
+}
+
+void MTA::StopBackgroundPlanner() {
+  if (!planner.joinable())
+    return;
+  {
+    lock_guard<mutex> lock(planner_mutex);
+    planner_stop = true;
+  }
+  planner_wakeup.notify_all();
+  planner.join();
+  round_done.notify_all();
+  // Threads waiting for a policy plan themselves now.
+  for (auto i : tasks) {
+    i.second->use_published_policy = false;
+    i.second->NotifyPolicyWaiters();
+  }
+}
+
+void MTA::PlanNow() {
+  unique_lock<mutex> lock(planner_mutex);
+  if (!planner.joinable()) {
+    lock.unlock();
+    RunPlanningRound(true);
+    return;
+  }
+  long round = rounds_started + 1;
+  plan_requested = true;
+  planner_wakeup.notify_all();
+  round_done.wait(lock, [this, round] {return rounds_done >= round || planner_stop;});
+}
+
+void MTA::RunPlanner() {
+  unique_lock<mutex> lock(planner_mutex);
+  while (!planner_stop) {
+    rounds_started++;
+    bool forced = plan_requested;
+    plan_requested = false;
+    // Work arriving from now on is left for the next round.
+    work_pending = false;
+    lock.unlock();
+    bool planned = RunPlanningRound(forced);
+    lock.lock();
+    rounds_done++;
+    round_done.notify_all();
+    // Without anything new, sleep until a buffer or a task has work.
+    if (!planned)
+      planner_wakeup.wait(lock, [this] {return planner_stop || plan_requested || work_pending;});
+  }
+}
+
+void MTA::WakePlanner() {
+  {
+    lock_guard<mutex> lock(planner_mutex);
+    work_pending = true;
+  }
+  planner_wakeup.notify_all();
+}
+
+bool MTA::RunPlanningRound(bool forced) {
+  bool merged = MergeExperience() > 0;
+  bool requested = false;
+  vector<bool> added(task_names.size(), false);
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    Task* task = tasks[task_names[i]];
+    added[i] = task->AddRequestedStates();
+    // Every task needs a first policy.
+    requested = requested || added[i] || !task->PublishedPolicy();
+  }
+  if (!merged && !requested && !forced)
+    return false;
+
+  map<string, future<long> > backups = PlanAll();
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    Task* task = tasks[task_names[i]];
+    // The policy only changes with the values or the held states.
+    if (backups[task_names[i]].get() > 0 || added[i] || !task->PublishedPolicy())
+      task->PublishPolicy();
+  }
+  return true;
 }
 
 void MTA::UseFSA() {
@@ -202,3 +389,152 @@ void MTA::UseFSA() {
   for (auto i : tasks)
     i.second->fsa = true;
 }
+
+void MTA::SetNumThreads(int num_threads) {
+  thread_pool.reset();
+  if (num_threads > 1)
+    thread_pool = make_shared<ThreadPool>(num_threads);
+  for (auto i : tasks)
+    i.second->SetThreadPool(thread_pool);
+}
+
+map<string, future<long> > MTA::PlanAll() {
+  // Largest tasks first, so that a large task does not start last while the
+  // other threads run out of work.
+  vector<string> order = task_names;
+  stable_sort(order.begin(), order.end(), [this](const string& x, const string& y) {
+    return long(tasks[x]->NumIndexedStates()) * tasks[x]->total_actions >
+        long(tasks[y]->NumIndexedStates()) * tasks[y]->total_actions;
+  });
+
+  map<string, future<long> > results;
+  for (unsigned int i = 0; i < order.size(); ++i) {
+    Task* task = tasks[order[i]];
+    function<long()> job = [this, task] {
+      task->RefreshTransitions();
+      GenerateRewardFunction(task);
+      return task->Solve();
+    };
+    if (thread_pool) {
+      results[order[i]] = thread_pool->Submit(job);
+    } else {
+      promise<long> backups;
+      backups.set_value(job());
+      results[order[i]] = backups.get_future();
+    }
+  }
+
+  // Help with the tasks not started yet.
+  if (thread_pool)
+    while (thread_pool->RunPendingJob()) {}
+  return results;
+}
+
+void MTA::EnableMetrics(bool enable) {
+  for (auto i : tasks)
+    i.second->metrics.Enable(enable);
+}
+
+string MTA::MetricsJson() const {
+  // Every update of a distribution increases its version by one.
+  long cdtb_updates = 0;
+  for (unsigned int k = 0; k < cdtb.size(); ++k)
+    for (unsigned int a = 0; a < cdtb[k].size(); ++a)
+      cdtb_updates += cdtb[k][a].version;
+
+  ostringstream out;
+  out << "{\"cdtb_updates\": " << cdtb_updates << ", \"tasks\": {";
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    out << (i ? ", " : "") << "\"" << task_names[i] << "\": "
+        << tasks.at(task_names[i])->MetricsSnapshot().ToJson();
+  }
+  out << "}}";
+  return out.str();
+}
+
+bool MTA::SaveCheckpoint(const string& path) const {
+  CheckpointWriter writer(path);
+  writer.WriteArray(feature_size);
+  writer.Write(total_actions);
+  writer.Write(exploration_threshold);
+  writer.Write(static_cast<char>(fsa));
+
+  writer.Write(static_cast<long>(components.size()));
+  for (unsigned int k = 0; k < components.size(); ++k) {
+    writer.WriteBits(components[k].in_task);
+    writer.WriteBits(components[k].features);
+  }
+
+  writer.Write(static_cast<long>(cdtb.size()));
+  for (unsigned int k = 0; k < cdtb.size(); ++k) {
+    writer.Write(static_cast<long>(cdtb[k].size()));
+    for (unsigned int a = 0; a < cdtb[k].size(); ++a)
+      cdtb[k][a].Save(writer);
+  }
+
+  writer.Write(static_cast<long>(task_names.size()));
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    writer.WriteArray(vector<char>(task_names[i].begin(), task_names[i].end()));
+    tasks.at(task_names[i])->Save(writer);
+  }
+  return writer.Close();
+}
+
+bool MTA::LoadCheckpoint(const string& path) {
+  // Everything is read and checked before any of it is restored, so that a
+  // rejected file leaves the learner as it was.
+  CheckpointReader reader(path);
+  vector<int> stored_feature_size;
+  int stored_threshold;
+  char stored_fsa;
+  if (!reader.ReadArray(stored_feature_size) || stored_feature_size != feature_size ||
+      !reader.Expect(total_actions) || !reader.Read(stored_threshold) ||
+      !reader.Read(stored_fsa) || bool(stored_fsa) != fsa)
+    return false;
+
+  if (!reader.Expect(static_cast<long>(components.size())))
+    return false;
+  for (unsigned int k = 0; k < components.size(); ++k) {
+    if (!reader.ExpectBits(components[k].in_task) ||
+        !reader.ExpectBits(components[k].features))
+      return false;
+  }
+
+  // The cells load into a copy, since a later part of the file may still be
+  // rejected.
+  vector<vector<Distribution> > stored_cdtb = cdtb;
+  if (!reader.Expect(static_cast<long>(stored_cdtb.size())))
+    return false;
+  for (unsigned int k = 0; k < stored_cdtb.size(); ++k) {
+    if (!reader.Expect(static_cast<long>(stored_cdtb[k].size())))
+      return false;
+    for (unsigned int a = 0; a < stored_cdtb[k].size(); ++a) {
+      if (!stored_cdtb[k][a].Load(reader))
+        return false;
+    }
+  }
+
+  if (!reader.Expect(static_cast<long>(task_names.size())))
+    return false;
+  vector<TaskCheckpoint> stored_tasks(task_names.size());
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    vector<char> name;
+    if (!reader.ReadArray(name) || string(name.begin(), name.end()) != task_names[i] ||
+        !tasks[task_names[i]]->Load(reader, stored_tasks[i]))
+      return false;
+  }
+
+  // The cells are swapped rather than assigned, so that they keep their
+  // addresses.
+  exploration_threshold = stored_threshold;
+  for (unsigned int k = 0; k < cdtb.size(); ++k) {
+    for (unsigned int a = 0; a < cdtb[k].size(); ++a)
+      swap(cdtb[k][a], stored_cdtb[k][a]);
+  }
+  for (unsigned int i = 0; i < task_names.size(); ++i) {
+    Task* task = tasks[task_names[i]];
+    task->exploration_threshold = exploration_threshold;
+    task->Restore(stored_tasks[i]);
+  }
+  return true;
+}
@@ -1,7 +1,13 @@
 #include <vector>
+#include <condition_variable>
 #include <map>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include "ExperienceBuffer.h"
 #include "task.h"
 #include "Utility.h"
 
@@ -20,15 +26,85 @@ class MTA {
   virtual void GenerateRewardFunction(Task* some_task) = 0;
   virtual void UpdateWithNewObservation(const vector<int>& last_state,
       int action, const vector<int>& curr_state, int reward) = 0;
+  // The column of cdtb[k] an observation of action updates, -1 for none.
+  // By default the cell of the action, or the no-op column if the action
+  // does not affect component k, i.e. its cell is empty. Override it to
+  // match UpdateWithNewObservation when it follows another rule.
+  virtual int ObservationColumn(int k, int action) const;
+  // Feeds count observations from a packed array, each being the last
+  // state, the action and the current state in 2 * feature_size.size() + 1
+  // ints. Updates the cells given by ObservationColumn in the same way as
+  // UpdateWithNewExperience in input order, so the result does not depend on
+  // the batching. Every state is encoded once per component, and the cells
+  // are updated concurrently on the pool of SetNumThreads.
+  void UpdateWithNewObservations(const int* observations, long count);
+
+  // Concurrent ingestion: every writer thread appends its observations to
+  // its own buffer, which never waits for planning, and the planning thread
+  // merges them into the cdtb with MergeExperience between plans. The cdtb
+  // then only changes at merges, so every plan reads one version of it. An
+  // append to an empty buffer wakes the background planner.
+  shared_ptr<ExperienceBuffer> NewExperienceBuffer();
+  // Applies the observations appended to every buffer since the last merge
+  // with UpdateWithNewObservations, buffer by buffer in creation order, and
+  // starts a new epoch. Must not run concurrently with planning or other
+  // cdtb updates. Returns the number of observations merged.
+  long MergeExperience();
+  // Number of merges so far, i.e. the version of the cdtb planned from.
+  long ExperienceEpoch() const {return experience_epoch;};
+
+  // Asynchronous planning: a background thread runs planning rounds, each
+  // merging the experience buffers, planning every task with PlanAll and
+  // publishing the policies that changed. Meanwhile SelectBestAction of
+  // every task returns from its newest published policy, waking the planner
+  // and waiting for the next policy while none covers the state. Until
+  // StopBackgroundPlanner the cdtb and the models of the tasks belong to
+  // that thread, so observations must go through experience buffers. A
+  // subclass freeing its tasks must stop the planner first.
+  void StartBackgroundPlanner();
+  void StopBackgroundPlanner();
+  // Forces a synchronous solve: returns once a planning round started after
+  // the call has published its policies. Runs the round on the calling
+  // thread if no background planner runs.
+  void PlanNow();
 
   // Use FSA. Call this function when the problem has synchronous arcs.
   // This function double the feature_size vector to include current step.
   // Only call the function after feature_size is initialized.
   void UseFSA();
 
+  // Shares a pool of num_threads threads between all tasks, for PlanAll and
+  // for the transition construction and value iteration of each task.
+  // Call after InitializeTasks.
+  void SetNumThreads(int num_threads);
+
+  // Rebuilds the transition and reward functions of every task and solves it,
+  // running the tasks concurrently on the shared pool. Each future holds the
+  // number of state backups of its task, keyed by task name.
+  // GenerateRewardFunction may run concurrently for different tasks, and the
+  // cdtb must not be updated until every future is ready.
+  map<string, future<long> > PlanAll();
+
+  // Turns the metrics of every task on or off.
+  void EnableMetrics(bool enable);
+  // The metrics of every task, and the number of cdtb updates, as JSON.
+  string MetricsJson() const;
+
+  // Writes the learner to a binary checkpoint at path: feature_size, the
+  // components, the contextual dependency table with its counts, and the
+  // model, values and policy of every task. Returns false on a write error.
+  bool SaveCheckpoint(const string& path) const;
+  // Restores a checkpoint written by SaveCheckpoint into a learner set up the
+  // same way, i.e. after InitializeTasks, ComputeComponents, UseFSA if used
+  // and GenerateContextualDependencyTable. Returns false if the file cannot be
+  // read or does not match the learner, which is then left unchanged.
+  bool LoadCheckpoint(const string& path);
+
   vector<string> task_names;
   map<string, Task*> tasks;
-  // Contextual Dependency Table
+  // Contextual Dependency Table, cdtb[k][a] for component k and action a.
+  // Every task holding both reads the same cell and its normalized
+  // probabilities, so they are counted and normalized once.
   vector<vector<Distribution> > cdtb;
   vector<Component> components;
 
@@ -42,4 +118,34 @@ class MTA {
   // Uses full synchronous arcs.
   // Set to false by default.
   bool fsa;
+
+ private:
+  shared_ptr<ThreadPool> thread_pool;
+
+  mutex buffers_mutex;
+  vector<shared_ptr<ExperienceBuffer> > experience_buffers;
+  // Observations taken from a buffer, kept to reuse their memory.
+  vector<int> merged;
+  long experience_epoch;
+
+  // Merges the experience buffers, then plans and publishes unless nothing
+  // was merged, no state was requested and the round is not forced.
+  // Returns true if it planned.
+  bool RunPlanningRound(bool forced);
+  void RunPlanner();
+  // Wakes the planner for new observations in a buffer or for a state no
+  // published policy covers.
+  void WakePlanner();
+  thread planner;
+  mutex planner_mutex;
+  // Wakes the planner for PlanNow and WakePlanner, and wakes PlanNow when a
+  // round is done.
+  condition_variable planner_wakeup;
+  condition_variable round_done;
+  bool planner_stop;
+  bool plan_requested;
+  // Set by WakePlanner, cleared when a round starts.
+  bool work_pending;
+  long rounds_started;
+  long rounds_done;
 };
@@ -1,55 +1,275 @@
 #include "task.h"
 #include "Utility.h"
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <stdint.h>
 
 // This function updates each entry in the contextual dependency table with
 // new observation.
 void Distribution::UpdateWithNewExperience(const vector<int>& last_state,
-    const vector<int>& current, const vector<int>& feature_size, bool fsa) {
-  vector<int> parent_feature_size = feature_size;
-
+    const vector<int>& current, bool fsa) {
   // Find the integer representation of the parent feature.
   int parent;
   if (!fsa)
-    parent = MapFactoredStateToInt(last_state, feature_size, parent_features);
+    parent = parent_codec.Encode(last_state);
   else
-    parent = CheckAndMapParentFSA(last_state, current, feature_size, parent_features);
+    parent = parent_codec.Encode(last_state.data(), current.data());
 
   // Find the integer representation of the component value.
-  int child = MapFactoredStateToInt(current, feature_size, component->features);
+  int child = child_codec.Encode(current);
+  AddExperience(parent, child);
+}
+
+void Distribution::AddExperience(int parent, int child) {
+  // Update the outcome count.
+  int index = FindOutcome(parent, child);
+  if (index == -1)
+    index = AddOutcome(parent, child);
+  outcomes[index].count++;
+
+  // Increment the visit count
+  exploration_count[parent]++;
+  Normalize(parent);
+  version++;
+  parent_version[parent] = version;
+}
 
-  // Update Probability
-  bool found = false;
-  for(vector<pair<long, double> >::iterator it = distribution[parent].begin();
-      it != distribution[parent].end(); ++it) {
-    if (it->first != child) {
-      it->second = it->second * (double(exploration_count[parent]) /
-         (exploration_count[parent] + 1));
+void Distribution::Normalize(int parent) {
+  // Moving a support may have grown the pool.
+  probabilities.resize(outcomes.size());
+  int offset = support_offsets[parent];
+  for (int i = 0; i < support_sizes[parent]; ++i) {
+    probabilities[offset + i] =
+        double(outcomes[offset + i].count) / exploration_count[parent];
+  }
+}
+
+void Distribution::Resize(int parent_size) {
+  this->parent_size = parent_size;
+  exploration_count.assign(parent_size, 0);
+  parent_version.assign(parent_size, 0);
+  support_offsets.assign(parent_size, 0);
+  support_sizes.assign(parent_size, 0);
+  outcomes.clear();
+  probabilities.clear();
+  hash_keys.clear();
+  hash_indices.clear();
+  hash_shift = 64;
+  hash_count = 0;
+}
+
+int Distribution::AddOutcome(int parent, int child) {
+  int size = support_sizes[parent];
+  int offset = support_offsets[parent];
+  // Sizes that are powers of two fill their capacity.
+  if ((size & (size - 1)) == 0) {
+    if (size > 0 && offset + size == static_cast<int>(outcomes.size())) {
+      // Last in the pool, grow in place.
+      outcomes.resize(offset + 2 * size);
+    } else {
+      int new_offset = outcomes.size();
+      outcomes.resize(new_offset + (size == 0 ? 1 : 2 * size));
+      for (int i = 0; i < size; ++i) {
+        outcomes[new_offset + i] = outcomes[offset + i];
+        InsertIntoHash(parent, outcomes[new_offset + i].child, new_offset + i);
+      }
+      offset = new_offset;
+      support_offsets[parent] = offset;
     }
-    else if (it->first == child) {
-      it->second = (it->second * double(exploration_count[parent]) + 1) /
-        (exploration_count[parent] + 1);
-      found = true;
+  }
+
+  OutcomeEntry outcome = {child, 0};
+  outcomes[offset + size] = outcome;
+  support_sizes[parent]++;
+  InsertIntoHash(parent, child, offset + size);
+  return offset + size;
+}
+
+// Fibonacci hashing of the (parent, child) key.
+static inline unsigned long HashSlot(long key, int shift) {
+  return (static_cast<unsigned long>(key) * 11400714819323198485ul) >> shift;
+}
+
+int Distribution::FindOutcome(int parent, int child) const {
+  if (hash_keys.empty())
+    return -1;
+  long key = (static_cast<long>(parent) << 32) | child;
+  unsigned long mask = hash_keys.size() - 1;
+  for (unsigned long slot = HashSlot(key, hash_shift); ; slot = (slot + 1) & mask) {
+    if (hash_keys[slot] == key)
+      return hash_indices[slot];
+    if (hash_keys[slot] == -1)
+      return -1;
+  }
+}
+
+void Distribution::InsertIntoHash(int parent, int child, int index) {
+  // Keep the load factor at most one half.
+  if (2 * (hash_count + 1) > static_cast<int>(hash_keys.size())) {
+    vector<long> old_keys;
+    vector<int> old_indices;
+    old_keys.swap(hash_keys);
+    old_indices.swap(hash_indices);
+    int new_size = old_keys.empty() ? 16 : 2 * old_keys.size();
+    hash_keys.assign(new_size, -1);
+    hash_indices.assign(new_size, 0);
+    hash_shift = 64;
+    for (int size = new_size; size > 1; size /= 2)
+      hash_shift--;
+    hash_count = 0;
+    for (unsigned long slot = 0; slot < old_keys.size(); ++slot) {
+      if (old_keys[slot] != -1)
+        InsertIntoHash(old_keys[slot] >> 32, old_keys[slot] & 0xffffffffl,
+            old_indices[slot]);
     }
   }
-  // Increment the visit count
-  exploration_count[parent]++;
-  if (!found) {
-    // Add a new entry
-    distribution[parent].push_back(make_pair(child, 1.0/exploration_count[parent]));
+
+  long key = (static_cast<long>(parent) << 32) | child;
+  unsigned long mask = hash_keys.size() - 1;
+  unsigned long slot = HashSlot(key, hash_shift);
+  while (hash_keys[slot] != -1 && hash_keys[slot] != key)
+    slot = (slot + 1) & mask;
+  if (hash_keys[slot] == -1)
+    hash_count++;
+  hash_keys[slot] = key;
+  hash_indices[slot] = index;
+}
+
+void Distribution::Save(CheckpointWriter& writer) const {
+  writer.Write(parent_size);
+  writer.WriteBits(parent_features);
+  writer.Write(version);
+  writer.WriteArray(exploration_count);
+  writer.WriteArray(parent_version);
+  writer.WriteArray(outcomes);
+  writer.WriteArray(support_offsets);
+  writer.WriteArray(support_sizes);
+  writer.Write(hash_shift);
+  writer.Write(hash_count);
+  writer.WriteArray(hash_keys);
+  writer.WriteArray(hash_indices);
+}
+
+bool Distribution::Load(CheckpointReader& reader) {
+  long stored_version;
+  vector<int> stored_exploration_count, stored_support_offsets, stored_support_sizes;
+  vector<long> stored_parent_version, stored_hash_keys;
+  vector<OutcomeEntry> stored_outcomes;
+  vector<int> stored_hash_indices;
+  int stored_hash_shift, stored_hash_count;
+  if (!reader.Expect(parent_size) || !reader.ExpectBits(parent_features) ||
+      !reader.Read(stored_version) || !reader.ReadArray(stored_exploration_count) ||
+      !reader.ReadArray(stored_parent_version) || !reader.ReadArray(stored_outcomes) ||
+      !reader.ReadArray(stored_support_offsets) || !reader.ReadArray(stored_support_sizes) ||
+      !reader.Read(stored_hash_shift) || !reader.Read(stored_hash_count) ||
+      !reader.ReadArray(stored_hash_keys) || !reader.ReadArray(stored_hash_indices))
+    return false;
+
+  // The counts are used as indices, so check them before trusting them.
+  unsigned long parents = parent_size;
+  long pool = stored_outcomes.size();
+  long slots = stored_hash_keys.size();
+  if (stored_exploration_count.size() != parents ||
+      stored_parent_version.size() != parents ||
+      stored_support_offsets.size() != parents || stored_support_sizes.size() != parents ||
+      stored_hash_indices.size() != stored_hash_keys.size() ||
+      (slots & (slots - 1)) != 0 || 2L * stored_hash_count > slots)
+    return false;
+  // The shift must map hashes to the slots, as set by InsertIntoHash.
+  int expected_shift = 64;
+  for (long size = slots; size > 1; size /= 2)
+    expected_shift--;
+  if (slots > 0 && stored_hash_shift != expected_shift)
+    return false;
+  for (int parent = 0; parent < parent_size; ++parent) {
+    if (stored_support_offsets[parent] < 0 || stored_support_sizes[parent] < 0 ||
+        stored_support_offsets[parent] + static_cast<long>(stored_support_sizes[parent]) > pool)
+      return false;
+  }
+  for (long i = 0; i < pool; ++i) {
+    if (stored_outcomes[i].child < 0 || stored_outcomes[i].child >= child_codec.FlatSize())
+      return false;
   }
+  // Probing stops at an empty slot, so the count of used ones must be right.
+  int used = 0;
+  for (long slot = 0; slot < slots; ++slot) {
+    if (stored_hash_keys[slot] == -1)
+      continue;
+    used++;
+    if (stored_hash_indices[slot] < 0 || stored_hash_indices[slot] >= pool)
+      return false;
+  }
+  if (used != stored_hash_count)
+    return false;
+
+  version = stored_version;
+  exploration_count.swap(stored_exploration_count);
+  parent_version.swap(stored_parent_version);
+  outcomes.swap(stored_outcomes);
+  support_offsets.swap(stored_support_offsets);
+  support_sizes.swap(stored_support_sizes);
+  hash_shift = stored_hash_shift;
+  hash_count = stored_hash_count;
+  hash_keys.swap(stored_hash_keys);
+  hash_indices.swap(stored_hash_indices);
+  // The probabilities are not stored.
+  probabilities.assign(outcomes.size(), 0);
+  for (int parent = 0; parent < parent_size; ++parent) {
+    if (exploration_count[parent] > 0)
+      Normalize(parent);
+  }
+  return true;
+}
+
+void Distribution::BuildCodecs(const vector<int>& feature_size, bool fsa) {
+  vector<int> parent_feature_size = feature_size;
+  // The FSA parent also covers the current time step.
+  if (fsa)
+    parent_feature_size.insert(parent_feature_size.end(), feature_size.begin(),
+        feature_size.end());
+  parent_codec = StateCodec(parent_feature_size, parent_features);
+  child_codec = StateCodec(feature_size, component->features);
 }
 
 Task::Task(const vector<bool>& features, const vector<bool>& actions, string name,
-    const vector<int>& feature_size, int rmax):
+    const vector<int>& feature_size, int rmax, bool sparse):
     features(features),
     actions(actions),
     task_name(name),
     feature_size(feature_size),
+    sparse(sparse),
     rmax(rmax) {
 
   total_actions = accumulate(actions.begin(), actions.end(), 0);
   total_steps = 0;
+  // Contextual dependency table is initialized later by MTA class.
+  cdtb = 0;
+  vi = 0;
+  discount = 0.9;
+  precision = 0.1;
+  InitializeStates();
+
+  fsa = false;
+  incremental_planning = true;
+  matrix_free = false;
+  unstored_changes = false;
+  factored = false;
+  factored_working_values = 0;
+  factored_values = 0;
+  action_gap_termination = false;
+  use_published_policy = false;
+  last_action_proven = false;
+  entry_grain = 64 * (total_actions > 0 ? total_actions : 1);
+  planned = false;
+}
+
+Task::~Task() {
+  delete vi;
+}
+
+void Task::InitializeStates() {
+  codec = StateCodec(feature_size, features);
   state_size = 1;
   for (unsigned int j = 0; j < features.size(); ++j) {
     if (features[j]) {
@@ -57,38 +277,33 @@ Task::Task(const vector<bool>& features, const vector<bool>& actions, string nam
     }
   }
 
+  // A sparse task starts with the fictitious state only.
+  fictitious_state = sparse ? 0 : state_size;
+  int held_states = sparse ? 0 : state_size;
+  state_index.Clear();
+  expanded_states = 1;
+  dependent_states = 0;
 
   // Includes fictitious state.
-  transition.resize(state_size + 1);
-  reward.resize(state_size + 1);
-  applicable_actions.resize(state_size + 1);
-  values.resize(state_size + 1, rmax/0.1);
-
-  for (int s = 0; s < state_size; ++s) {
-    transition[s].resize(total_actions);
-    // Reward initialize to rmax.
-    reward[s].resize(total_actions, rmax);
-    // By default every action is available.
-    applicable_actions[s].resize(total_actions, true);
+  transition.Reset(held_states + 1, total_actions);
+  // Reward initialize to rmax, and by default every action is available.
+  reward.Reset(held_states + 1, total_actions, rmax);
+  applicable_actions.assign((held_states + 1) * total_actions, true);
+  // Initial state value for value iteration, also for the fictitious state.
+  values.assign(held_states + 1, rmax / (1 - discount));
 
-    // Initial state value for value iteration.
-    values[s] = rmax/0.1;
+  // A new solver, keeping the settings of the old one.
+  ValueIteration* old_vi = vi;
+  vi = new ValueIteration(held_states + 1, total_actions, discount, applicable_actions, values);
+  vi->setRewardBounds(-numeric_limits<double>::infinity(), rmax);
+  if (old_vi) {
+    vi->setSolver(old_vi->getSolver());
+    vi->setThreadPool(thread_pool);
+    delete old_vi;
   }
-
-  // Initialize for the fictitious state.
-  transition[state_size].resize(total_actions);
-  reward[state_size].resize(total_actions, rmax);
-  applicable_actions[state_size].resize(total_actions, true);
-
-  // Contextual dependency table is initialized later by MTA class.
-  cdtb = 0;
-  vi = new ValueIteration(state_size + 1, total_actions, 0.9, applicable_actions, values);
-
-  fsa = false;
-}
-
-Task::~Task() {
-  delete vi;
+  planned = false;
+  ClearChangedStates();
+  dirty_entries.resize(0);
 }
 
 int Task::MapGlobalToLocal(const int global, const vector<bool>& bit_map) {
@@ -124,77 +339,78 @@ int Task::MapLocalToGlobal(const int local,
 // This function should only be called after the contextual
 // dependency table is constructed.
 void Task::ConstructTransitionFunction() {
+  // The factored solver reads the cdtb directly.
+  if (Factored())
+    return;
   if (fsa) {
     ConstructTransitionFunctionFSA();
     return;
   }
+  PhaseTimer timer(metrics, Metrics::CONSTRUCT_TRANSITIONS);
+  ConstructStates();
+}
 
-  // Iterate over all states.
-  for(int i = 0; i < state_size; ++i) {
-    // Looping through the contextual dependency table.
-    // Each action is a different column in the table.
-    for (int a = 0; a < total_actions; ++a) {
-      FindNextStates(i, a);
-    }
-  }
+void Task::FindNextStates(int state, int action) {
+  bool fictitious = ComputeNextStates(state, action, scratch);
+  CommitNextStates(state, action, fictitious, scratch.next.data(),
+      scratch.prob.data(), scratch.next.size());
+}
 
-  // Constructing the transition function for the fictitious state.
-  for (int a = 0; a < total_actions; ++a) {
-    // Transit to itself.
-    transition[state_size][a].resize(0);
-    transition[state_size][a].push_back(make_pair(state_size, 1.0));
-    reward[state_size][a] = rmax;
+bool Task::ComputeNextStates(int state, int action, Scratch& scratch) const {
+  if (MatrixFree()) {
+    // Only whether the pair is explored, backups find the next states.
+    scratch.next.resize(0);
+    scratch.prob.resize(0);
+    double unused;
+    return SumNextValues(state, action, 0, scratch, unused);
   }
-}
 
-void Task::FindNextStates(int state, int action) {
-  vector<int> current_state;
-  MapIntStateToVector(state, feature_size, features, current_state);
+  vector<int>& current_state = scratch.current_state;
+  current_state.assign(features.size(), -1);
+  codec.Decode(StateKey(state), current_state);
 
-  // Total number of components used by this task.
-  total_components = accumulate(components.begin(), components.end(), 0);
   // Iterate over |a| columns of k rows in the contextual dependency table.
   // This records the position of iteration.
-  vector<int> counter(total_components, 0);
-  // action must be converted to global index to access contextual dependency table.
-  int global_a = MapLocalToGlobal(action, actions);
+  vector<int>& counter = scratch.counter;
+  counter.assign(total_components, 0);
 
-  vector<int> component_order;
-  ComputeOrderFSA(component_order);
+  // The cells of this action, indexed by local component.
+  const Distribution* const* cells = &plan.cells[action * total_components];
+  const vector<int>& component_order = plan.component_order;
 
-  // Reset all contents in the transition function.
-  transition[state][action].resize(0);
+  // Entries are collected here and written to the transition function later.
+  vector<long>& next_buffer = scratch.next;
+  vector<double>& prob_buffer = scratch.prob;
+  next_buffer.resize(0);
+  prob_buffer.resize(0);
 
   // Different components have different parents, thus they need to be computed.
-  vector<int> parents(total_components, 0);
+  vector<int>& parents = scratch.parents;
+  parents.assign(total_components, 0);
 
   // Constructing transition function for state i action a.
   bool terminate = false;
   double probability;
 
-  // Reset the counter.
-  fill(counter.begin(), counter.end(), 0);
-
   // If exploration count is less than threshold, set the flag to true.
   bool fictitious_state_flag = false;
+  vector<int>& next_state = scratch.next_state;
   while (!terminate) {
-    vector<int> next_state(features.size(), -1);
-    // Fill in next_state.
+    if (fsa)
+      next_state.assign(features.size(), -1);
+    // Fill in next_state, or only its encoding without FSA.
+    int next_key = 0;
     probability = 1.0;
     for (int l = 0; l < total_components; ++l) {
       int k = component_order[l];
-      // k is a local component index and thus needs to be converted to global index
-      // to access contextual dependency table.
-      int global_k = MapLocalToGlobal(k, components);
+      const Distribution& cell = *cells[k];
       if (!fsa)
-        parents[k] = MapFactoredStateToInt(current_state, feature_size,
-                  (*cdtb)[global_k][global_a].parent_features);
+        parents[k] = cell.parent_codec.Encode(current_state);
       else
-        parents[k] = CheckAndMapParentFSA(current_state, next_state, feature_size,
-                  (*cdtb)[global_k][global_a].parent_features);
+        parents[k] = cell.parent_codec.Encode(current_state.data(), next_state.data());
 
       // If the exploration threshold is not reached, transit to the fictitious state;
-      if ((*cdtb)[global_k][global_a].exploration_count[parents[k]] < exploration_threshold) {
+      if (cell.exploration_count[parents[k]] < exploration_threshold) {
         fictitious_state_flag = true;
         break;
       }
@@ -202,37 +418,25 @@ void Task::FindNextStates(int state, int action) {
       // Debug
       /*
       cout << "parents[k] is " << parents[k] << "\n";
-      cout << (*cdtb)[global_k][global_a].distribution.size() << "\n";
       cout << "counter[l] is " << counter[l] << "\n";
-      cout << (*cdtb)[global_k][global_a].distribution[parents[k]].size() << "\n";
+      cout << cell.SupportSize(parents[k]) << "\n";
       */
 
-      int component_value = (*cdtb)[global_k][global_a].distribution[parents[k]][counter[l]].first;
-      vector<int> component;
-      MapIntStateToVector(component_value, feature_size,
-          component_info[global_k]->features, component);
+      int component_value = cell.Outcome(parents[k], counter[l]);
 
       // Debug
       /*
       cout << "This component has value " << component_value << "\n";
-      cout << "This component has features ";
-      for (auto j : component_info[global_k]->features)
-        cout << j << " ";
-      cout << "\n";
-      cout << "This component has values ";
-      for (auto j : component)
-        cout << j << " ";
-      cout << "\n";
       */
 
-      // Combining component features to form the next state
-      for (unsigned int m = 0; m < features.size(); ++m) {
-        if (component_info[global_k]->features[m]) {
-          next_state[m] = component[m];
-        }
-      }
+      // Combining component features to form the next state. The parents
+      // of later FSA components read it.
+      if (fsa)
+        plan.component_codecs[k]->Decode(component_value, next_state);
+      else
+        next_key += plan.component_keys[k][component_value];
 
-      probability *= (*cdtb)[global_k][global_a].distribution[parents[k]][counter[l]].second;
+      probability *= cell.Probability(parents[k], counter[l]);
     }
 
     // Skip constructing transition function
@@ -248,34 +452,175 @@ void Task::FindNextStates(int state, int action) {
     cout << "with probability " << probability << "\n";
     */
 
-    transition[state][action].push_back(make_pair(MapFactoredStateToInt(next_state,
-            feature_size, features), probability));
+    next_buffer.push_back(fsa ? codec.Encode(next_state) : next_key);
+    prob_buffer.push_back(probability);
 
     // Increment Counter. Starting from the last counter.
     counter[total_components-1]++;
     for (int l = total_components -1; l > 0; l--) {
       int k = component_order[l];
-      int global_k = MapLocalToGlobal(k, components);
-      counter[l-1] += counter[l]/(*cdtb)[global_k][global_a].distribution[parents[k]].size();
-      counter[l] %= (*cdtb)[global_k][global_a].distribution[parents[k]].size();
+      counter[l-1] += counter[l]/cells[k]->SupportSize(parents[k]);
+      counter[l] %= cells[k]->SupportSize(parents[k]);
     }
 
     // Check if first counter has reached the end.
-    int first = MapLocalToGlobal(component_order[0], components);
-    if (static_cast<unsigned int>(counter[0])
-        >= (*cdtb)[first][global_a].distribution[parents[component_order[0]]].size()) {
+    int first = component_order[0];
+    if (counter[0] >= cells[first]->SupportSize(parents[first])) {
       terminate = true;
       break;
     }
   }
 
-  if (fictitious_state_flag) {
+  return fictitious_state_flag;
+}
+
+double Task::ExpectedValue(long state, long action, const vector<double>& values) const {
+  // Backups of one solve may run on several threads.
+  static thread_local Scratch backup_scratch;
+  double expected = 0;
+  // With FSA an under-explored parent may only show up during the
+  // enumeration, after part of the sum was added.
+  if (SumNextValues(state, action, values.data(), backup_scratch, expected))
+    return values[fictitious_state];
+  return expected;
+}
+
+bool Task::SumNextValues(int state, int action, const double* values,
+    Scratch& scratch, double& expected) const {
+  vector<int>& current_state = scratch.current_state;
+  current_state.assign(features.size(), -1);
+  codec.Decode(StateKey(state), current_state);
+  const Distribution* const* cells = &plan.cells[action * total_components];
+  expected = 0;
+  if (fsa) {
+    // Parents are found while the next state is filled in.
+    scratch.next_state.assign(features.size(), -1);
+  } else {
+    // Every parent is part of the current state.
+    scratch.parents.resize(total_components);
+    for (int k = 0; k < total_components; ++k) {
+      scratch.parents[k] = cells[k]->parent_codec.Encode(current_state);
+      if (cells[k]->exploration_count[scratch.parents[k]] < exploration_threshold)
+        return true;
+    }
+    if (!values)
+      return false;
+  }
+  return SumComponentValues(0, cells, 0, 1.0, values, scratch, expected);
+}
+
+bool Task::SumComponentValues(int l, const Distribution* const* cells, int key,
+    double probability, const double* values, Scratch& scratch,
+    double& expected) const {
+  if (l == total_components) {
+    if (values)
+      expected += probability * values[fsa ? codec.Encode(scratch.next_state) : key];
+    return false;
+  }
+  int k = plan.component_order[l];
+  const Distribution& cell = *cells[k];
+  int parent;
+  if (fsa) {
+    parent = cell.parent_codec.Encode(scratch.current_state.data(),
+        scratch.next_state.data());
+    if (cell.exploration_count[parent] < exploration_threshold)
+      return true;
+  } else {
+    parent = scratch.parents[k];
+  }
+  for (int i = 0; i < cell.SupportSize(parent); ++i) {
+    int component_value = cell.Outcome(parent, i);
+    if (fsa)
+      plan.component_codecs[k]->Decode(component_value, scratch.next_state);
+    if (SumComponentValues(l + 1, cells, key + plan.component_keys[k][component_value],
+          probability * cell.Probability(parent, i), values, scratch, expected))
+      return true;
+  }
+  return false;
+}
+
+void Task::CommitNextStates(int state, int action, bool fictitious,
+    const long* next, const double* prob, long count) {
+  metrics.Count(Metrics::TRANSITIONS_BUILT);
+  if (fictitious) {
+    metrics.Count(Metrics::FICTITIOUS_TRANSITIONS);
     // Transit to fictitious state with probability 1.
-    // The fictitious state has an index of "state_size".
-    transition[state][action].resize(0);
-    transition[state][action].push_back(make_pair(state_size, 1.0));
-    reward[state][action] = rmax;
+    // The fictitious state has an index of "fictitious_state".
+    transition.Assign(state, action, fictitious_state, 1.0);
+    reward.Set(state, action, rmax);
+  } else if (MatrixFree()) {
+    // An empty entry, whose backups ExpectedValue computes.
+    transition.Assign(state, action, next, prob, 0);
+    unstored_changes = true;
+  } else if (sparse) {
+    // Next states are flat states, and may be new.
+    mapped_next.resize(count);
+    for (long i = 0; i < count; ++i)
+      mapped_next[i] = StateOfKey(next[i]);
+    transition.Assign(state, action, mapped_next.data(), prob, count);
+  } else {
+    transition.Assign(state, action, next, prob, count);
+  }
+}
+
+void Task::FindNextStatesOfEntries(long count,
+    const function<pair<int, int>(long)>& entry) {
+  if (!thread_pool || thread_pool->NumThreads() == 1 || count < 2 * entry_grain) {
+    for (long i = 0; i < count; ++i) {
+      pair<int, int> e = entry(i);
+      FindNextStates(e.first, e.second);
+    }
+    return;
   }
+
+  // Every chunk computes its entries into its own buffer in parallel.
+  // The buffers are then written to the table in order, so the result is
+  // the same as the serial one.
+  long chunks = (count + entry_grain - 1) / entry_grain;
+  if (static_cast<long>(entry_chunks.size()) < chunks)
+    entry_chunks.resize(chunks);
+  thread_pool->ParallelFor(count, entry_grain, [&](long begin, long end) {
+    EntryChunk& chunk = entry_chunks[begin / entry_grain];
+    chunk.counts.resize(0);
+    chunk.next.resize(0);
+    chunk.prob.resize(0);
+    for (long i = begin; i < end; ++i) {
+      pair<int, int> e = entry(i);
+      bool fictitious = ComputeNextStates(e.first, e.second, chunk.scratch);
+      // -1 marks a transition to the fictitious state.
+      chunk.counts.push_back(fictitious ? -1 : chunk.scratch.next.size());
+      if (!fictitious) {
+        chunk.next.insert(chunk.next.end(), chunk.scratch.next.begin(),
+            chunk.scratch.next.end());
+        chunk.prob.insert(chunk.prob.end(), chunk.scratch.prob.begin(),
+            chunk.scratch.prob.end());
+      }
+    }
+  });
+
+  for (long c = 0; c < chunks; ++c) {
+    EntryChunk& chunk = entry_chunks[c];
+    long offset = 0;
+    for (unsigned long j = 0; j < chunk.counts.size(); ++j) {
+      pair<int, int> e = entry(c * entry_grain + j);
+      long n = chunk.counts[j] < 0 ? 0 : chunk.counts[j];
+      CommitNextStates(e.first, e.second, chunk.counts[j] < 0,
+          chunk.next.data() + offset, chunk.prob.data() + offset, n);
+      offset += n;
+    }
+  }
+}
+
+void Task::SetNumThreads(int num_threads) {
+  if (num_threads <= 1)
+    SetThreadPool(shared_ptr<ThreadPool>());
+  else
+    SetThreadPool(make_shared<ThreadPool>(num_threads));
+}
+
+void Task::SetThreadPool(shared_ptr<ThreadPool> pool) {
+  thread_pool = pool;
+  vi->setThreadPool(pool);
 }
 
 void Task::ComputeOrderFSA(vector<int>& component_order) {
@@ -284,7 +629,7 @@ void Task::ComputeOrderFSA(vector<int>& component_order) {
   // Loop down from the number of tasks to 0.
   for (int i = component_info[0]->in_task.size(); i > 0; --i) {
     for (int k = 0; k < total_components; ++k) {
-      int global_k = MapLocalToGlobal(k, components);
+      int global_k = plan.global_component[k];
       if (accumulate(component_info[global_k]->in_task.begin(),
             component_info[global_k]->in_task.end(), 0) == i) {
         component_order.push_back(k);
@@ -304,62 +649,572 @@ void Task::ComputeOrderFSA(vector<int>& component_order) {
 
 // The FSA version of transition function construction.
 void Task::ConstructTransitionFunctionFSA() {
-  // Total number of components used by this task.
-  total_components = accumulate(components.begin(), components.end(), 0);
+  PhaseTimer timer(metrics, Metrics::CONSTRUCT_TRANSITIONS);
+  ConstructStates();
+}
 
-  // Iterate over |a| columns of k rows in the contextual dependency table.
-  // This records the position of iteration.
-  vector<int> counter(total_components, 0);
+void Task::ConstructStates() {
+  if (sparse) {
+    // Without cdtb changes only the new states need computing.
+    ExpandStates(CdtbChangedSinceConstruction() ? 1 : expanded_states);
+    RecordCdtbVersions();
+    return;
+  }
+
+  vi->setBackupModel(MatrixFree() ? this : 0);
+  // Nothing to rebuild if no distribution used by the task changed.
+  if (!CdtbChangedSinceConstruction())
+    return;
+
+  // Entries are rebuilt in place, so the table can tell which ones changed.
 
   // Iterate over all states.
-  for(int i = 0; i < state_size; ++i) {
-    vector<int> current_state;
-    MapIntStateToVector(i, feature_size, features, current_state);
+  // Looping through the contextual dependency table.
+  // Each action is a different column in the table.
+  FindNextStatesOfEntries(static_cast<long>(state_size) * total_actions,
+      [this](long i) {return make_pair(int(i / total_actions), int(i % total_actions));});
+
+  // Constructing the transition function for the fictitious state.
+  for (int a = 0; a < total_actions; ++a) {
+    // Transit to itself.
+    transition.Assign(state_size, a, state_size, 1.0);
+    reward.Set(state_size, a, rmax);
+  }
+
+  // Entries that grew were moved, pack them again.
+  transition.Compact();
+  RecordCdtbVersions();
+}
+
+void Task::ExpandStates(int begin) {
+  bool begin_all = begin <= 1;
+  GrowStates();
+  // Every round computes the states found by the previous one.
+  while (begin < NumIndexedStates()) {
+    int end = NumIndexedStates();
+    FindNextStatesOfEntries(static_cast<long>(end - begin) * total_actions,
+        [this, begin](long i) {
+          return make_pair(int(begin + i / total_actions), int(i % total_actions));
+        });
+    GrowStates();
+    begin = end;
+  }
+  expanded_states = NumIndexedStates();
+
+  for (int a = 0; a < total_actions; ++a) {
+    transition.Assign(fictitious_state, a, fictitious_state, 1.0);
+    reward.Set(fictitious_state, a, rmax);
+  }
+  // After a partial expansion Assign compacts once garbage outweighs the
+  // live entries, which keeps steady state refreshes from copying the table.
+  if (begin_all)
+    transition.Compact();
+  // Keep the reverse index of RefreshTransitions up to date.
+  if (!dependent_offsets.empty())
+    BuildDependencies();
+}
+
+void Task::GrowStates() {
+  int held = NumIndexedStates();
+  int found = state_index.Size() + 1;
+  if (found == held)
+    return;
+  transition.Grow(found);
+  reward.Grow(found, rmax);
+  applicable_actions.resize(found * total_actions, true);
+  values.resize(found, rmax / (1 - discount));
+  vi->addStates(found - held, rmax / (1 - discount));
+}
+
+int Task::AddState(const vector<int>& state) {
+  int index = StateOfKey(codec.Encode(state));
+  if (sparse)
+    GrowStates();
+  return index;
+}
+
+void Task::Save(CheckpointWriter& writer) const {
+  writer.Write(state_size);
+  writer.Write(total_actions);
+  writer.Write(total_steps);
+  writer.Write(static_cast<char>(sparse));
+  writer.WriteArray(state_index.Keys());
+  writer.Write(expanded_states);
+  transition.Save(writer);
+  writer.WriteArray(reward.Rewards());
+  writer.WriteArray(vi->values);
+  writer.WriteArray(vi->actions);
+  writer.WriteArray(vi->getResidualBounds());
+  writer.Write(static_cast<char>(planned));
+  // The states the next plan re-solves.
+  vector<long> pending(changed_states);
+  vector<bool> pending_flag(NumIndexedStates(), false);
+  for (unsigned long i = 0; i < pending.size(); ++i)
+    pending_flag[pending[i]] = true;
+  for (int table = 0; table < 2; ++table) {
+    const vector<long>& changed = table == 0 ? transition.ChangedStates() : reward.ChangedStates();
+    for (unsigned long i = 0; i < changed.size(); ++i) {
+      if (!pending_flag[changed[i]]) {
+        pending_flag[changed[i]] = true;
+        pending.push_back(changed[i]);
+      }
+    }
+  }
+  writer.WriteArray(pending);
+  writer.WriteArray(constructed_versions);
+}
+
+bool Task::Load(CheckpointReader& reader, TaskCheckpoint& stored) const {
+  vector<long> keys;
+  char stored_planned;
+  if (!reader.Expect(state_size) || !reader.Expect(total_actions) ||
+      !reader.Read(stored.total_steps) || !reader.Expect(static_cast<char>(sparse)) ||
+      !reader.ReadArray(keys) || !reader.Read(stored.expanded_states) ||
+      !stored.transition.Load(reader) ||
+      !reader.ReadArray(stored.rewards) || !reader.ReadArray(stored.values) ||
+      !reader.ReadArray(stored.actions) || !reader.ReadArray(stored.residual_bounds) ||
+      !reader.Read(stored_planned) || !reader.ReadArray(stored.pending) ||
+      !reader.ReadArray(stored.constructed_versions))
+    return false;
+  stored.planned = stored_planned;
+
+  // The held states of a sparse task, each once.
+  stored.state_index.Clear();
+  if (sparse) {
+    for (unsigned long i = 0; i < keys.size(); ++i) {
+      if (keys[i] < 0 || keys[i] >= state_size)
+        return false;
+      stored.state_index.Insert(keys[i]);
+    }
+    if (static_cast<unsigned long>(stored.state_index.Size()) != keys.size())
+      return false;
+  } else if (!keys.empty()) {
+    return false;
+  }
+
+  // TransitionTable::Load checks that every next state is one of its
+  // states, so with this check every next state is held.
+  long held = sparse ? keys.size() + 1 : state_size + 1;
+  unsigned long pairs = held * total_actions;
+  if (stored.expanded_states < 1 || stored.expanded_states > held ||
+      stored.transition.NumStates() != held ||
+      stored.transition.NumActions() != total_actions ||
+      stored.rewards.size() != pairs ||
+      stored.values.size() != static_cast<unsigned long>(held) ||
+      (!stored.actions.empty() && stored.actions.size() != stored.values.size()) ||
+      (!stored.constructed_versions.empty() &&
+       stored.constructed_versions.size() != plan.cells.size()))
+    return false;
+  for (unsigned long i = 0; i < stored.actions.size(); ++i) {
+    if (stored.actions[i] < 0 || stored.actions[i] >= total_actions)
+      return false;
+  }
+  for (unsigned long i = 0; i < stored.pending.size(); ++i) {
+    if (stored.pending[i] < 0 || stored.pending[i] >= held)
+      return false;
+  }
+  return true;
+}
+
+void Task::Restore(TaskCheckpoint& stored) {
+  // A sparse task drops its states and takes the stored ones, so that its
+  // tables have the size of the stored ones.
+  if (sparse) {
+    InitializeStates();
+    swap(state_index, stored.state_index);
+    GrowStates();
+  }
+  total_steps = stored.total_steps;
+  expanded_states = stored.expanded_states;
+  transition.Swap(stored.transition);
+  transition.ClearChanges();
+  reward.SetRewards(stored.rewards);
+  values = stored.values;
+  vi->setSolution(stored.values, stored.actions, stored.residual_bounds);
+  vi->setBackupModel(MatrixFree() ? this : 0);
+  // The factored solution is not stored, so the next plan solves again.
+  factored_solution.reset();
+  factored_diagram.reset();
+  planned = stored.planned;
+  constructed_versions.swap(stored.constructed_versions);
+  // The tables restore without changes, so the pending ones are kept here.
+  ClearChangedStates();
+  changed_flag.resize(NumIndexedStates(), false);
+  for (unsigned long i = 0; i < stored.pending.size(); ++i) {
+    if (!changed_flag[stored.pending[i]]) {
+      changed_flag[stored.pending[i]] = true;
+      changed_states.push_back(stored.pending[i]);
+    }
+  }
+  dirty_entries.resize(0);
+  // The reverse index is rebuilt from the restored states.
+  dependent_offsets.resize(0);
+  dependent_states = 0;
+}
+
+bool Task::ExportPolicy(const string& path) {
+  if (sparse || Factored())
+    return false;
+
+  // After an incremental plan vi->actions is only current for the states
+  // that were backed up, so take the greedy actions again.
+  vector<int> policy(state_size);
+  for (int s = 0; s < state_size; ++s)
+    policy[s] = vi->greedyAction(s, reward, transition);
+
+  CheckpointWriter writer(path);
+  string kind = "policy";
+  writer.WriteArray(vector<char>(kind.begin(), kind.end()));
+  writer.WriteArray(feature_size);
+  writer.WriteBits(features);
+  writer.WriteArray(plan.global_action);
+  if (total_actions <= 256) {
+    writer.Write(1);
+    writer.WriteArray(vector<uint8_t>(policy.begin(), policy.end()));
+  } else {
+    writer.Write(2);
+    writer.WriteArray(vector<uint16_t>(policy.begin(), policy.end()));
+  }
+  return writer.Close();
+}
+
+long Task::Solve() {
+  PhaseTimer timer(metrics, Metrics::SOLVE);
+  if (Factored())
+    return SolveFactored();
+  if (!incremental_planning || !planned) {
+    vi -> doValueIteration(reward, transition, precision);
+    planned = true;
+    CollectChangedStates();
+    ClearChangedStates();
+  } else {
+    // The previous values are still a solution for every state whose model
+    // did not change, so only the changed states seed the re-plan.
+    CollectChangedStates();
+    if (changed_states.empty() && !unstored_changes && !vi->hasPendingBackups())
+      return 0;
+    vi -> doValueIteration(reward, transition, precision, changed_states);
+    ClearChangedStates();
+  }
+  unstored_changes = false;
+  CountSolve();
+  return vi->getBackups();
+}
+
+bool Task::SolveForAction(int state, int& best_action, long max_backups) {
+  if (Factored()) {
+    Solve();
+    vector<int> current_state(features.size(), -1);
+    DecodeState(state, current_state);
+    best_action = FactoredAction(*factored_solution, factored_action_values,
+        current_state);
+    return false;
+  }
+  PhaseTimer timer(metrics, Metrics::SOLVE);
+  bool full = !incremental_planning || !planned;
+  CollectChangedStates();
+  long action;
+  bool proven = vi->solveForAction(reward, transition, precision, state, action,
+      max_backups, full ? 0 : &changed_states);
+  ClearChangedStates();
+  planned = true;
+  unstored_changes = false;
+  best_action = action;
+  CountSolve();
+  return proven;
+}
+
+void Task::SetFactoredReward(const vector<bool>& reward_features,
+    const function<double(const vector<int>& state, int action)>& reward) {
+  vector<bool> task_reward_features(features.size(), false);
+  for (unsigned int j = 0; j < features.size(); ++j)
+    task_reward_features[j] = reward_features[j] && features[j];
+  reward_codec = StateCodec(feature_size, task_reward_features);
+  int reward_size = reward_codec.FlatSize();
+  factored_reward.resize(static_cast<long>(total_actions) * reward_size);
+  vector<int> state(features.size(), -1);
+  for (int r = 0; r < reward_size; ++r) {
+    reward_codec.Decode(r, state);
+    for (int a = 0; a < total_actions; ++a)
+      factored_reward[a * reward_size + r] = reward(state, plan.global_action[a]);
+  }
+  // Solve again at the next plan, from the old values.
+  factored_model.reward.resize(0);
+  constructed_versions.resize(0);
+}
+
+void Task::UpdateFactoredModel() {
+  DecisionDiagram& diagram = *factored_diagram;
+  FactoredModel& model = factored_model;
+  vector<int> state(features.size(), -1);
+  if (model.reward.empty()) {
+    model.reward.assign(total_actions, diagram.Leaf(rmax));
+    if (!factored_reward.empty()) {
+      int reward_size = reward_codec.FlatSize();
+      const vector<int>& reward_features = reward_codec.RelevantFeatures();
+      vector<vector<int> > assignments(reward_size, vector<int>(reward_features.size()));
+      for (int r = 0; r < reward_size; ++r) {
+        reward_codec.Decode(r, state);
+        for (unsigned int i = 0; i < reward_features.size(); ++i)
+          assignments[r][i] = state[reward_features[i]];
+      }
+      for (int a = 0; a < total_actions; ++a) {
+        vector<double> action_reward(factored_reward.begin() + a * reward_size,
+            factored_reward.begin() + (a + 1) * reward_size);
+        model.reward[a] = diagram.Build(reward_features, assignments, action_reward, 0);
+      }
+    }
+  }
+
+  model.outcomes.resize(plan.cells.size());
+  model.probabilities.resize(plan.cells.size());
+  model.explored.resize(plan.cells.size());
+  model.versions.resize(plan.cells.size(), -1);
+  vector<bool> changed_actions(total_actions, model.known.empty());
+  for (unsigned int c = 0; c < plan.cells.size(); ++c) {
+    const Distribution& cell = *plan.cells[c];
+    if (model.versions[c] == cell.version)
+      continue;
+    model.versions[c] = cell.version;
+    changed_actions[c / total_components] = true;
+
+    const vector<int>& parent_features = cell.parent_codec.RelevantFeatures();
+    // The explored parent values, and for every outcome the parent values
+    // it was seen given, with its probabilities.
+    vector<vector<int> > explored;
+    vector<vector<vector<int> > > outcome_parents;
+    vector<vector<double> > outcome_probabilities;
+    vector<int>& outcomes = model.outcomes[c];
+    outcomes.resize(0);
+    for (int parent = 0; parent < cell.parent_size; ++parent) {
+      if (cell.exploration_count[parent] < exploration_threshold)
+        continue;
+      cell.parent_codec.Decode(parent, state);
+      vector<int> assignment(parent_features.size());
+      for (unsigned int i = 0; i < parent_features.size(); ++i)
+        assignment[i] = state[parent_features[i]];
+      for (int i = 0; i < cell.SupportSize(parent); ++i) {
+        int outcome = find(outcomes.begin(), outcomes.end(), cell.Outcome(parent, i)) -
+            outcomes.begin();
+        if (outcome == static_cast<int>(outcomes.size())) {
+          outcomes.push_back(cell.Outcome(parent, i));
+          outcome_parents.push_back(vector<vector<int> >());
+          outcome_probabilities.push_back(vector<double>());
+        }
+        outcome_parents[outcome].push_back(assignment);
+        outcome_probabilities[outcome].push_back(cell.Probability(parent, i));
+      }
+      explored.push_back(assignment);
+    }
+
+    model.explored[c] = diagram.Build(parent_features, explored,
+        vector<double>(explored.size(), 1), 0);
+    model.probabilities[c].resize(0);
+    for (unsigned int i = 0; i < outcomes.size(); ++i) {
+      model.probabilities[c].push_back(diagram.Build(parent_features,
+          outcome_parents[i], outcome_probabilities[i], 0));
+    }
+  }
+
+  model.known.resize(total_actions);
+  for (int a = 0; a < total_actions; ++a) {
+    if (!changed_actions[a])
+      continue;
+    model.known[a] = diagram.Leaf(1);
+    for (int k = 0; k < total_components; ++k) {
+      model.known[a] = diagram.Apply(model.known[a],
+          model.explored[a * total_components + k], DecisionDiagram::MIN);
+    }
+  }
+}
+
+DecisionDiagram::Node Task::Regress(int action, DecisionDiagram::Node values,
+    unordered_map<DecisionDiagram::Node, DecisionDiagram::Node>& regressed) {
+  DecisionDiagram& diagram = *factored_diagram;
+  if (diagram.IsLeaf(values))
+    return values;
+  unordered_map<DecisionDiagram::Node, DecisionDiagram::Node>::iterator found =
+      regressed.find(values);
+  if (found != regressed.end())
+    return found->second;
 
-    // Looping through the contextual dependency table.
-    // Each action is a different column in the table.
+  // Components move independently given the current state, so the
+  // expectation over the component of the top feature is the sum over its
+  // values of their probability times the expectation of the values
+  // restricted to them, which no longer test that component.
+  int k = feature_component[diagram.Var(values)];
+  int c = action * total_components + k;
+  const vector<int>& outcomes = factored_model.outcomes[c];
+  vector<int> assignment(features.size(), -1);
+  DecisionDiagram::Node expected = diagram.Leaf(0);
+  for (unsigned int i = 0; i < outcomes.size(); ++i) {
+    plan.component_codecs[k]->Decode(outcomes[i], assignment);
+    DecisionDiagram::Node next = Regress(action, diagram.Restrict(values, assignment),
+        regressed);
+    expected = diagram.Apply(expected, diagram.Apply(factored_model.probabilities[c][i],
+        next, DecisionDiagram::MULTIPLY), DecisionDiagram::ADD);
+  }
+  regressed[values] = expected;
+  return expected;
+}
+
+long Task::SolveFactored() {
+  if (factored_solution && !CdtbChangedSinceConstruction())
+    return 0;
+  // The value of the fictitious state.
+  const double fictitious_value = rmax / (1 - discount);
+  // Nodes are never freed, so the values move to a new diagram once the
+  // diagram takes this many.
+  const long max_nodes = 1 << 22;
+
+  if (factored_diagram && factored_diagram->NumNodes() > max_nodes)
+    factored_diagram.reset();
+  if (!factored_diagram) {
+    factored_diagram.reset(new DecisionDiagram(feature_size));
+    factored_model = FactoredModel();
+    // Values only decrease from an upper bound, as in vi, or start from the
+    // last solution.
+    factored_working_values = factored_solution ?
+        factored_diagram->Copy(*factored_solution, factored_values) :
+        factored_diagram->Leaf(fictitious_value);
+  }
+  long built = -factored_diagram->NumNodes();
+  UpdateFactoredModel();
+
+  DecisionDiagram& diagram = *factored_diagram;
+  DecisionDiagram::Node values = factored_working_values;
+  vector<DecisionDiagram::Node> action_values(total_actions);
+  long iterations = 0;
+  double change = numeric_limits<double>::infinity();
+  while (change > precision) {
+    DecisionDiagram::Node next_values = diagram.Leaf(-numeric_limits<double>::infinity());
     for (int a = 0; a < total_actions; ++a) {
-      FindNextStates(i, a);
+      // Pairs with an unexplored parent lead to the fictitious state.
+      DecisionDiagram::Node unknown = diagram.Apply(diagram.Leaf(1),
+          diagram.Apply(diagram.Leaf(-1), factored_model.known[a], DecisionDiagram::MULTIPLY),
+          DecisionDiagram::ADD);
+      unordered_map<DecisionDiagram::Node, DecisionDiagram::Node> regressed;
+      DecisionDiagram::Node expected = Regress(a, values, regressed);
+      DecisionDiagram::Node backup = diagram.Apply(factored_model.reward[a],
+          diagram.Apply(diagram.Leaf(discount), expected, DecisionDiagram::MULTIPLY),
+          DecisionDiagram::ADD);
+      action_values[a] = diagram.Apply(
+          diagram.Apply(factored_model.known[a], backup, DecisionDiagram::MULTIPLY),
+          diagram.Apply(unknown, diagram.Leaf(fictitious_value), DecisionDiagram::MULTIPLY),
+          DecisionDiagram::ADD);
+      next_values = diagram.Apply(next_values, action_values[a], DecisionDiagram::MAX);
     }
+    change = diagram.MaxValue(diagram.Apply(next_values, values,
+        DecisionDiagram::ABS_DIFFERENCE));
+    values = next_values;
+    iterations++;
   }
+  built += diagram.NumNodes();
+  factored_working_values = values;
 
-  // Constructing the transition function for the fictitious state.
+  // The solution goes to a diagram of its own, which is shared with the
+  // published policies.
+  shared_ptr<DecisionDiagram> solution = make_shared<DecisionDiagram>(feature_size);
+  factored_values = solution->Copy(diagram, values);
+  factored_action_values.resize(total_actions);
+  for (int a = 0; a < total_actions; ++a)
+    factored_action_values[a] = solution->Copy(diagram, action_values[a]);
+  factored_solution = solution;
+  RecordCdtbVersions();
+
+  metrics.Count(Metrics::SOLVES);
+  metrics.Count(Metrics::VI_ITERATIONS, iterations);
+  metrics.SetResidual(change);
+  return built;
+}
+
+int Task::FactoredAction(const DecisionDiagram& diagram,
+    const vector<DecisionDiagram::Node>& action_values,
+    const vector<int>& state) const {
+  int best_action = 0;
+  double best_value = -numeric_limits<double>::infinity();
   for (int a = 0; a < total_actions; ++a) {
-    // Transit to itself.
-    transition[state_size][a].resize(0);
-    transition[state_size][a].push_back(make_pair(state_size, 1.0));
-    reward[state_size][a] = rmax;
+    double value = diagram.Evaluate(action_values[a], state.data());
+    if (value > best_value) {
+      best_value = value;
+      best_action = a;
+    }
   }
+  return best_action;
+}
+
+double Task::FactoredValue(const vector<int>& state) const {
+  if (!factored_solution)
+    return rmax / (1 - discount);
+  return factored_solution->Evaluate(factored_values, state.data());
+}
+
+void Task::CountSolve() {
+  metrics.Count(Metrics::SOLVES);
+  metrics.Count(Metrics::VI_ITERATIONS, vi->getIterations());
+  metrics.Count(Metrics::BACKUPS, vi->getBackups());
+  metrics.SetResidual(vi->getResidual());
+}
+
+Metrics Task::MetricsSnapshot() const {
+  Metrics snapshot = metrics;
+  snapshot.SetGauge(Metrics::TRANSITION_BYTES, transition.MemoryBytes());
+  snapshot.SetGauge(Metrics::REWARD_BYTES, reward.MemoryBytes());
+  return snapshot;
 }
 
 int Task::SelectBestAction(const vector<int>& current_state, bool speedup) {
+  if (use_published_policy) {
+    int action = ServePublishedPolicy(current_state);
+    if (action >= 0)
+      return action;
+  }
+
+  PhaseTimer timer(metrics, Metrics::SELECT_BEST_ACTION);
+  if (Factored()) {
+    Solve();
+    total_steps++;
+    return plan.global_action[FactoredAction(*factored_solution,
+        factored_action_values, current_state)];
+  }
   if (speedup == true) {
     // If any component action pair is not sufficiently explored, just execute this action
     for (int k = 0; k < total_components; ++k) {
-      int global_k = MapLocalToGlobal(k, components);
-      int parent_k = MapFactoredStateToInt(current_state, feature_size, component_info[global_k]->features);
+      int parent_k = plan.component_codecs[k]->Encode(current_state);
       for (int a = 0; a < total_actions; ++a) {
-        int global_a = MapLocalToGlobal(a, actions);
-        if ((*cdtb)[global_k][global_a].exploration_count[parent_k] < exploration_threshold) {
-          return global_a;
+        if (plan.cells[a * total_components + k]->exploration_count[parent_k] < exploration_threshold) {
+          return plan.global_action[a];
         }
       }
     }
 
     // Else run vi for every 50 steps. For the other steps, just use the old policy.
-    int curr = MapFactoredStateToInt(current_state, feature_size, features);
+    int curr = AddState(current_state);
     if (total_steps % 50 != 0) {
       int a = vi->actions[curr];
-      return MapLocalToGlobal(a, actions);
+      return plan.global_action[a];
     }
   }
 
-  vi -> doValueIteration(reward, transition, 0.1);
-  int s = MapFactoredStateToInt(current_state, feature_size, features);
-  int best_action = vi->actions[s];
+  int s = AddState(current_state);
+  // A state a sparse task did not reach yet still has to be computed.
+  if (sparse && s >= expanded_states)
+    ConstructTransitionFunction();
+  int best_action;
+  if (action_gap_termination) {
+    last_action_proven = SolveForAction(s, best_action);
+  } else {
+    // A full solve leaves the greedy actions in vi.
+    bool full = !incremental_planning || !planned;
+    Solve();
+    if (full)
+      best_action = vi->actions[s];
+    else
+      best_action = vi->greedyAction(s, reward, transition);
+  }
 
   // The action returned should be converted to global index.
-  int global_action = MapLocalToGlobal(best_action, actions);
+  int global_action = plan.global_action[best_action];
 
   // Debug
   /*
@@ -367,8 +1222,8 @@ int Task::SelectBestAction(const vector<int>& current_state, bool speedup) {
     cout << "Printing transition function for state " << s << "\n";
     for (int a =0; a < total_actions; ++a) {
       cout << "Printing transition function for action " << a << "\n";
-      for (auto j : transition[s][a]) {
-        cout << j.first << " " << j.second << " ";
+      for (long k = transition.Begin(s, a); k < transition.End(s, a); ++k) {
+        cout << transition.NextState(k) << " " << transition.Probability(k) << " ";
       }
       cout << "\n";
     }
@@ -378,16 +1233,16 @@ int Task::SelectBestAction(const vector<int>& current_state, bool speedup) {
   cout << "Printing the transition function for last state\n";
   for (int a = 0; a < total_actions; ++a) {
     cout << "action is " << a << "\n";
-    for (auto i : transition[s][a]) {
-      cout << i.first << " " << i.second << "\n";
+    for (long k = transition.Begin(s, a); k < transition.End(s, a); ++k) {
+      cout << transition.NextState(k) << " " << transition.Probability(k) << "\n";
     }
   }
 
   for (int s = 0; s <= state_size; ++s) {
     cout << "Value for state " << s << " is " << values[s] << "\n";
     cout << "Applicable actions are ";
-    for (auto a : applicable_actions[s])
-      cout << a << " ";
+    for (int a = 0; a < total_actions; ++a)
+      cout << applicable_actions[s * total_actions + a] << " ";
     cout << "\n";
   }
   cout << "\n";
@@ -397,8 +1252,8 @@ int Task::SelectBestAction(const vector<int>& current_state, bool speedup) {
   cout << "Current value is " << values[s] << "\n";
 
   cout << "Reward is ";
-  for (auto i : reward[s])
-    cout << i << " ";
+  for (int a = 0; a < total_actions; ++a)
+    cout << reward.Get(s, a) << " ";
   cout << "\n";
 
   */
@@ -406,3 +1261,317 @@ int Task::SelectBestAction(const vector<int>& current_state, bool speedup) {
   total_steps++;
   return global_action;
 }
+
+int Task::ServePublishedPolicy(const vector<int>& current_state) {
+  int key = Factored() ? 0 : codec.Encode(current_state);
+  while (use_published_policy) {
+    shared_ptr<const Policy> policy = PublishedPolicy();
+    if (policy && Factored()) {
+      policy->served++;
+      return plan.global_action[FactoredAction(*policy->diagram,
+          policy->action_values, current_state)];
+    }
+    // Index 0 of a sparse task is the fictitious state, so the state is not
+    // held yet.
+    int index = !policy ? 0 : sparse ? policy->index.Find(key) + 1 : key;
+    if (policy && (!sparse || index > 0)) {
+      policy->served++;
+      return policy->actions[index];
+    }
+    if (sparse) {
+      lock_guard<mutex> lock(requested_mutex);
+      requested_states.push_back(key);
+    }
+    if (request_plan)
+      request_plan();
+    unique_lock<mutex> lock(policy_mutex);
+    policy_published.wait(lock, [this, &policy] {
+      return PublishedPolicy() != policy || !use_published_policy;
+    });
+  }
+  return -1;
+}
+
+void Task::NotifyPolicyWaiters() {
+  // Taking the mutex orders the change before the check of a waiter.
+  {
+    lock_guard<mutex> lock(policy_mutex);
+  }
+  policy_published.notify_all();
+}
+
+void Task::PublishPolicy() {
+  shared_ptr<Policy> policy = make_shared<Policy>();
+  if (Factored()) {
+    // The solution is never changed, so it is shared.
+    policy->diagram = factored_solution;
+    policy->action_values = factored_action_values;
+    policy->solved_at = chrono::steady_clock::now();
+    atomic_store(&published_policy, shared_ptr<const Policy>(policy));
+    NotifyPolicyWaiters();
+    return;
+  }
+  // As in ExportPolicy, vi->actions may be stale after an incremental plan.
+  policy->actions.resize(NumIndexedStates());
+  for (int s = 0; s < NumIndexedStates(); ++s)
+    policy->actions[s] = plan.global_action[vi->greedyAction(s, reward, transition)];
+  if (sparse)
+    policy->index = state_index;
+  policy->solved_at = chrono::steady_clock::now();
+  atomic_store(&published_policy, shared_ptr<const Policy>(policy));
+  NotifyPolicyWaiters();
+}
+
+long Task::PolicyAgeSteps() const {
+  shared_ptr<const Policy> policy = PublishedPolicy();
+  return policy ? policy->served.load() : -1;
+}
+
+double Task::PolicyAgeSeconds() const {
+  shared_ptr<const Policy> policy = PublishedPolicy();
+  if (!policy)
+    return -1;
+  return chrono::duration<double>(chrono::steady_clock::now() - policy->solved_at).count();
+}
+
+bool Task::AddRequestedStates() {
+  vector<long> requested;
+  {
+    lock_guard<mutex> lock(requested_mutex);
+    requested.swap(requested_states);
+  }
+  for (unsigned int i = 0; i < requested.size(); ++i)
+    StateOfKey(requested[i]);
+  if (sparse)
+    GrowStates();
+  return !requested.empty();
+}
+
+int Task::SelectBestActionWithin(const vector<int>& current_state,
+    double max_seconds, long max_backups) {
+  // The model and the solver belong to the planner.
+  if (use_published_policy) {
+    int action = ServePublishedPolicy(current_state);
+    if (action >= 0)
+      return action;
+  }
+  if (Factored())
+    return SelectBestAction(current_state);
+  PhaseTimer timer(metrics, Metrics::SELECT_BEST_ACTION);
+  int s = AddState(current_state);
+  if (sparse && s >= expanded_states)
+    ConstructTransitionFunction();
+  int best_action = vi->doRTDP(reward, transition, s, precision, max_seconds, max_backups);
+  metrics.Count(Metrics::BACKUPS, vi->getBackups());
+  total_steps++;
+  return plan.global_action[best_action];
+}
+
+void Task::RefreshTransitions() {
+  if (Factored())
+    return;
+  PhaseTimer timer(metrics, Metrics::REFRESH_TRANSITIONS);
+  if (constructed_versions.empty()) {
+    ConstructTransitionFunction();
+    return;
+  }
+  BuildDependencies();
+
+  // Mark the entries depending on parent values updated since the last refresh.
+  dirty.resize(NumIndexedStates() * total_actions, false);
+  for (int a = 0; a < total_actions; ++a) {
+    for (int k = 0; k < total_components; ++k) {
+      const Distribution& cell = *plan.cells[a * total_components + k];
+      long seen = constructed_versions[a * total_components + k];
+      if (cell.version == seen)
+        continue;
+      int lists = dependent_offsets[a * total_components + k];
+      for (int parent = 0; parent < cell.parent_size; ++parent) {
+        if (cell.parent_version[parent] <= seen)
+          continue;
+        for (int i = dependent_heads[lists + parent]; i >= 0; i = dependent_next[i]) {
+          int state = dependent_state[i];
+          if (!dirty[state * total_actions + a]) {
+            dirty[state * total_actions + a] = true;
+            dirty_entries.push_back(make_pair(state, a));
+          }
+        }
+      }
+    }
+  }
+
+  FindNextStatesOfEntries(dirty_entries.size(),
+      [this](long i) {return dirty_entries[i];});
+  for (unsigned int i = 0; i < dirty_entries.size(); ++i)
+    dirty[dirty_entries[i].first * total_actions + dirty_entries[i].second] = false;
+  dirty_entries.resize(0);
+  // The rebuilt entries may lead to new states.
+  if (sparse)
+    ExpandStates(expanded_states);
+  RecordCdtbVersions();
+}
+
+void Task::BuildDependencies() {
+  if (dependent_offsets.empty()) {
+    dependent_offsets.resize(plan.cells.size() + 1);
+    dependent_offsets[0] = 0;
+    for (unsigned int cell = 0; cell < plan.cells.size(); ++cell)
+      dependent_offsets[cell + 1] = dependent_offsets[cell] + plan.cells[cell]->parent_size;
+    dependent_heads.assign(dependent_offsets.back(), -1);
+    dependent_tails.assign(dependent_offsets.back(), -1);
+    dependent_state.resize(0);
+    dependent_next.resize(0);
+    dependent_states = sparse ? 1 : 0;
+  }
+
+  // States whose transitions are computed but not indexed yet.
+  int end = sparse ? expanded_states : state_size;
+  if (dependent_states >= end)
+    return;
+  // Without FSA every state has one entry per cell.
+  if (dependent_state.empty()) {
+    dependent_state.reserve(static_cast<long>(end - dependent_states) * plan.cells.size());
+    dependent_next.reserve(dependent_state.capacity());
+  }
+  vector<int> current_state(features.size(), -1);
+  vector<int> next_state(features.size(), 0);
+  for (int s = dependent_states; s < end; ++s) {
+    codec.Decode(StateKey(s), current_state);
+    for (int a = 0; a < total_actions; ++a) {
+      for (int k = 0; k < total_components; ++k) {
+        const vector<bool>& parent_features = plan.cells[a * total_components + k]->parent_features;
+        const StateCodec& parent_codec = plan.cells[a * total_components + k]->parent_codec;
+        int cell = a * total_components + k;
+        if (!fsa) {
+          AddDependent(cell, parent_codec.Encode(current_state), s);
+          continue;
+        }
+
+        // With FSA the parent also holds next step features, so enumerate
+        // every value they can take.
+        fill(next_state.begin(), next_state.end(), 0);
+        bool done = false;
+        while (!done) {
+          AddDependent(cell, parent_codec.Encode(current_state.data(),
+              next_state.data()), s);
+          done = true;
+          for (int j = features.size() - 1; j >= 0; --j) {
+            if (!parent_features[j + features.size()])
+              continue;
+            if (++next_state[j] < feature_size[j]) {
+              done = false;
+              break;
+            }
+            next_state[j] = 0;
+          }
+        }
+      }
+    }
+  }
+  dependent_states = end;
+}
+
+void Task::AddDependent(int cell, int parent, int state) {
+  int list = dependent_offsets[cell] + parent;
+  int entry = dependent_state.size();
+  dependent_state.push_back(state);
+  dependent_next.push_back(-1);
+  if (dependent_tails[list] < 0)
+    dependent_heads[list] = entry;
+  else
+    dependent_next[dependent_tails[list]] = entry;
+  dependent_tails[list] = entry;
+}
+
+bool Task::CdtbChangedSinceConstruction() {
+  if (constructed_versions.size() != plan.cells.size())
+    return true;
+  for (unsigned int cell = 0; cell < plan.cells.size(); ++cell) {
+    if (plan.cells[cell]->version != constructed_versions[cell])
+      return true;
+  }
+  return false;
+}
+
+void Task::RecordCdtbVersions() {
+  constructed_versions.resize(plan.cells.size());
+  for (unsigned int cell = 0; cell < plan.cells.size(); ++cell)
+    constructed_versions[cell] = plan.cells[cell]->version;
+}
+
+void Task::BuildPlan() {
+  total_components = accumulate(components.begin(), components.end(), 0);
+
+  plan.global_action.resize(0);
+  plan.local_action.assign(actions.size(), -1);
+  for (unsigned int a = 0; a < actions.size(); ++a) {
+    if (actions[a]) {
+      plan.local_action[a] = plan.global_action.size();
+      plan.global_action.push_back(a);
+    }
+  }
+  plan.global_component.resize(0);
+  plan.local_component.assign(components.size(), -1);
+  for (unsigned int k = 0; k < components.size(); ++k) {
+    if (components[k]) {
+      plan.local_component[k] = plan.global_component.size();
+      plan.global_component.push_back(k);
+    }
+  }
+
+  // ComputeOrderFSA uses the global component table.
+  plan.component_order.resize(0);
+  ComputeOrderFSA(plan.component_order);
+
+  plan.cells.resize(total_actions * total_components);
+  plan.component_codecs.resize(total_components);
+  plan.component_keys.resize(total_components);
+  vector<int> state(features.size(), 0);
+  for (int k = 0; k < total_components; ++k) {
+    int global_k = plan.global_component[k];
+    plan.component_codecs[k] = &component_info[global_k]->codec;
+    const StateCodec& component_codec = component_info[global_k]->codec;
+    plan.component_keys[k].resize(component_codec.FlatSize());
+    for (int v = 0; v < component_codec.FlatSize(); ++v) {
+      component_codec.Decode(v, state);
+      plan.component_keys[k][v] = codec.Encode(state);
+    }
+    state.assign(features.size(), 0);
+    for (int a = 0; a < total_actions; ++a)
+      plan.cells[a * total_components + k] = &(*cdtb)[global_k][plan.global_action[a]];
+  }
+  feature_component.assign(features.size(), -1);
+  for (int k = 0; k < total_components; ++k) {
+    const vector<int>& component_features = plan.component_codecs[k]->RelevantFeatures();
+    for (unsigned int i = 0; i < component_features.size(); ++i)
+      feature_component[component_features[i]] = k;
+  }
+
+  // The plan changes the meaning of the recorded cells.
+  constructed_versions.resize(0);
+  dependent_offsets.resize(0);
+  dependent_states = 0;
+}
+
+void Task::CollectChangedStates() {
+  // Rewards are written through RewardTable::Set, which records the states
+  // it changed like the transition table does.
+  changed_flag.resize(NumIndexedStates(), false);
+  for (int table = 0; table < 2; ++table) {
+    const vector<long>& changed = table == 0 ? transition.ChangedStates() : reward.ChangedStates();
+    for (unsigned long i = 0; i < changed.size(); ++i) {
+      if (!changed_flag[changed[i]]) {
+        changed_flag[changed[i]] = true;
+        changed_states.push_back(changed[i]);
+      }
+    }
+  }
+  transition.ClearChanges();
+  reward.ClearChanges();
+}
+
+void Task::ClearChangedStates() {
+  for (unsigned long i = 0; i < changed_states.size(); ++i)
+    changed_flag[changed_states[i]] = false;
+  changed_states.resize(0);
+}
@@ -1,7 +1,19 @@
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <string>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include "Checkpoint.h"
+#include "DecisionDiagram.h"
+#include "Metrics.h"
+#include "RewardTable.h"
+#include "StateCodec.h"
+#include "StateIndex.h"
 #include "ValueIteration.h"
 
 using namespace std;
@@ -13,38 +25,148 @@ class Component {
   vector<bool> in_task;
   // List of features contained in this component.
   vector<bool> features;
+  // Encodes the values of the component features.
+  StateCodec codec;
 };
 
 // A distribution maps some parent values to component values.
 // Conditional distribution of component values given the parents.
 class Distribution {
  public:
-  // Stores the distribution
-  // First vector is the parent, second vector is the actual distribution
-  // given the parent.
-  vector<vector<pair<long, double> > > distribution;
+  Distribution(): parent_size(0), version(0), component(0), hash_shift(64),
+      hash_count(0) {}
+
+  // Sizes the distribution for parent_size parent values, all unexplored.
+  void Resize(int parent_size);
+
+  // The outcomes observed given a parent value, in the order they were
+  // first observed. Probabilities are the outcome counts over the
+  // exploration count of the parent. They are normalized when the parent is
+  // updated, so every task reading the cell shares them.
+  int SupportSize(int parent) const {return support_sizes[parent];};
+  int Outcome(int parent, int i) const {return outcomes[support_offsets[parent] + i].child;};
+  int OutcomeCount(int parent, int i) const {return outcomes[support_offsets[parent] + i].count;};
+  double Probability(int parent, int i) const {
+    return probabilities[support_offsets[parent] + i];
+  }
 
   // Stores the exploration count.
   // Its size should be set by the MTA-FRMAX algorithm.
+  // This is the total outcome count of every parent value.
   vector<int> exploration_count;
 
   // This is also the size of exploration_count vector.
   // Number of values the parent features can take.
   int parent_size;
 
+  // Increased by every update, so readers can tell whether it changed.
+  long version;
+  // The version right after the last update of each parent value.
+  vector<long> parent_version;
+
   // The parent features of the distribution. 1 represents being used.
   vector<bool> parent_features;
   // Provides method to update with new experience.
+  // The codecs must have been built.
   void UpdateWithNewExperience(const vector<int>& last_state,
-      const vector<int>& current, const vector<int>& feature_size, bool fsa = false);
+      const vector<int>& current, bool fsa = false);
+  // Same, with the parent and component values already encoded.
+  void AddExperience(int parent, int child);
+
+  // Builds parent_codec and child_codec once parent_features and component
+  // are set.
+  void BuildCodecs(const vector<int>& feature_size, bool fsa);
+  // Encodes parent values. With FSA it covers the last and current state.
+  StateCodec parent_codec;
+  // Encodes component values.
+  StateCodec child_codec;
   // The values of the component it represents.
   Component* component;
+
+  // Writes the counts to a checkpoint, or restores them from one. The parent
+  // features and codecs must already be those of the stored distribution.
+  void Save(CheckpointWriter& writer) const;
+  bool Load(CheckpointReader& reader);
+
+ private:
+  struct OutcomeEntry {
+    int child;
+    int count;
+  };
+  // Appends child to the support of parent and returns its pool index.
+  int AddOutcome(int parent, int child);
+  // Index of child in the pool, or -1 if it was never observed given parent.
+  int FindOutcome(int parent, int child) const;
+  void InsertIntoHash(int parent, int child, int index);
+  // Recomputes the probabilities of the support of parent.
+  void Normalize(int parent);
+
+  // Outcome counts of every parent value in one pool. The support of parent
+  // p is outcomes[support_offsets[p] .. support_offsets[p] + support_sizes[p]).
+  // Its capacity is the next power of two of its size; a full support is
+  // moved to the end of the pool with twice the capacity.
+  vector<OutcomeEntry> outcomes;
+  // Probability of every outcome, indexed like outcomes.
+  vector<double> probabilities;
+  vector<int> support_offsets;
+  vector<int> support_sizes;
+
+  // Open addressing hash from (parent, child) to the pool index, with linear
+  // probing. Empty slots hold -1 as key.
+  vector<long> hash_keys;
+  vector<int> hash_indices;
+  int hash_shift;
+  int hash_count;
 };
 
-class Task {
+// Index tables and cdtb cells of a task. They are fixed once the contextual
+// dependency table is generated, and built then by Task::BuildPlan.
+struct TaskPlan {
+  // Local to global action and component indices.
+  vector<int> global_action;
+  vector<int> global_component;
+  // Global to local action and component indices, -1 if not in the task.
+  vector<int> local_action;
+  vector<int> local_component;
+  // Local components in the order their values are evaluated.
+  vector<int> component_order;
+  // cells[a * total_components + k] is the cdtb cell of local action a and
+  // local component k.
+  vector<const Distribution*> cells;
+  // Codecs of the local components.
+  vector<const StateCodec*> component_codecs;
+  // component_keys[k][v] is the part of the task state encoding held by the
+  // features of local component k with value v. Without FSA a next state is
+  // the sum of those of its component values.
+  vector<vector<int> > component_keys;
+};
+
+// The part of a checkpoint holding a task, read and checked by Task::Load
+// before Task::Restore applies it.
+struct TaskCheckpoint {
+  int total_steps;
+  // The held states of a sparse task.
+  StateIndex state_index;
+  int expanded_states;
+  TransitionTable transition;
+  vector<double> rewards;
+  vector<double> values;
+  vector<int> actions;
+  vector<double> residual_bounds;
+  bool planned;
+  // States changed since the last plan.
+  vector<long> pending;
+  vector<long> constructed_versions;
+};
+
+class Task : public BackupModel {
  public:
+  // With sparse set, the task only holds the states it reaches: states are
+  // added by AddState and SelectBestAction, and ConstructTransitionFunction
+  // adds the states they lead to, so value iteration runs over the reachable
+  // set. Otherwise every state of the product space is held.
   Task(const vector<bool>& features, const vector<bool>& actions, string name,
-       const vector<int>& feature_size, int rmax);
+       const vector<int>& feature_size, int rmax, bool sparse = false);
   ~Task();
 
   // Could be a task or a task element
@@ -64,6 +186,25 @@ class Task {
   vector<int> feature_size;
   // Total number of states
   int state_size;
+  // Encodes the task features.
+  StateCodec codec;
+
+  // Set by the constructor.
+  bool sparse;
+  // Index of the fictitious state: state_size, or 0 for a sparse task.
+  int fictitious_state;
+  // Number of states held including the fictitious state, i.e. the size of
+  // the transition function, reward, values and applicable_actions.
+  // state_size + 1 unless the task is sparse.
+  int NumIndexedStates() const {return transition.NumStates();};
+  // Writes the features of a held state other than the fictitious one into
+  // state, which holds every feature.
+  void DecodeState(int index, vector<int>& state) const {
+    codec.Decode(StateKey(index), state);
+  }
+  // Index of a state holding every feature. A sparse task adds it if needed;
+  // it then leads to the fictitious state until the next construction.
+  int AddState(const vector<int>& state);
 
   // Set of all components used. Only filled after all tasks are known.
   // 1 represent the component being used.
@@ -74,17 +215,23 @@ class Task {
 
   bool is_task;
 
-  // Task Transition Function
-  vector<vector<vector<pair<long, double> > > > transition;
+  // Task Transition Function, packed by (state, action).
+  TransitionTable transition;
   // Task Reward Function
-  vector<vector<double> > reward;
+  RewardTable reward;
   // The maximum reward assigned by rmax
   int rmax;
+  // Discount of the task MDP, and the precision every plan solves it to.
+  // 0.9 and 0.1 by default. The solver takes the discount when built by
+  // InitializeStates, so changing it only applies from then.
+  double discount;
+  double precision;
 
   // Total number of steps has been executed in this task.
   int total_steps;
 
   // Action 0 for a task is not necessarily action 0 for the problem.
+  // These scan the bit map; Plan() holds the same mappings as tables.
   // Map component/action from global index to local index.
   int MapGlobalToLocal(const int global, const vector<bool>& global_list);
   // Map component/action from local index to global index.
@@ -96,26 +243,347 @@ class Task {
   const vector<vector<Distribution> >* cdtb;
   int exploration_threshold;
 
+  // Builds the plan. Called by the MTA once the contextual dependency table
+  // is generated.
+  void BuildPlan();
+  const TaskPlan& Plan() const {return plan;};
+
   void ConstructTransitionFunction();
   void ConstructTransitionFunctionFSA();
+  // Rebuilds only the (state, action) entries that depend on cdtb parent
+  // values updated since the last construction or refresh.
+  // Constructs the whole transition function the first time. Sparse tasks
+  // then compute the states the rebuilt entries lead to.
+  void RefreshTransitions();
   void FindNextStates(int state, int action);
 
+  // Builds the transition function with num_threads threads, splitting the
+  // states into chunks. The result is the same as with one thread, the default.
+  // The threads are used by vi as well.
+  void SetNumThreads(int num_threads);
+  // Same, with threads shared with other users of pool.
+  void SetThreadPool(shared_ptr<ThreadPool> pool);
+
   // FSA may not execute in order. Check thesis for this section.
   void ComputeOrderFSA(vector<int>& component_order);
 
   // Solve the task MDP using value iteration
   // If speedup is true, then reduces the frequency of running VI.
   int SelectBestAction(const vector<int>& current_state, bool speedup = false);
+  // Anytime version for a hard latency budget: instead of solving to
+  // convergence, runs real-time dynamic programming trials from the current
+  // state, starting from the values of earlier plans, until max_seconds of
+  // wall-clock time or max_backups state backups are spent (0 for no limit).
+  // Later plans of SelectBestAction stay incremental. With
+  // use_published_policy it serves the published policy as SelectBestAction
+  // does, since the budget is then spent by the planner.
+  int SelectBestActionWithin(const vector<int>& current_state,
+      double max_seconds, long max_backups = 0);
+
+  // Writes the model, values and policy to a checkpoint.
+  void Save(CheckpointWriter& writer) const;
+  // Reads them back into stored and checks them, without changing the task.
+  // Returns false if they are malformed or do not fit the task, which must
+  // have the same features and actions as the stored one and its plan built.
+  bool Load(CheckpointReader& reader, TaskCheckpoint& stored) const;
+  // Replaces the model, values and policy by those of stored, taking them.
+  void Restore(TaskCheckpoint& stored);
+
+  // Writes the greedy policy of the current values for PolicyServer, with
+  // the actions stored in one byte when the task has at most 256 actions and
+  // in two bytes otherwise. Returns false on a write error, and for sparse
+  // and factored tasks, which have no table over the product space.
+  bool ExportPolicy(const string& path);
+
+  // A greedy policy published for threads selecting actions while another
+  // thread plans. Never changed once published.
+  struct Policy {
+    Policy(): served(0) {}
+    // Global action of every held state.
+    vector<int> actions;
+    // For a factored task, the action values instead, by local action.
+    shared_ptr<const DecisionDiagram> diagram;
+    vector<DecisionDiagram::Node> action_values;
+    // The held states of a sparse task.
+    StateIndex index;
+    chrono::steady_clock::time_point solved_at;
+    // Number of actions SelectBestAction returned from it.
+    mutable atomic<long> served;
+  };
+  // Publishes the greedy policy of the current values, replacing the last
+  // one through an atomic pointer swap. Called by the thread planning the
+  // task, e.g. the background planner of MTA.
+  void PublishPolicy();
+  shared_ptr<const Policy> PublishedPolicy() const {return atomic_load(&published_policy);};
+  // If true, SelectBestAction and SelectBestActionWithin return the action
+  // of the newest published policy. They then neither plan nor touch the
+  // model, so they may run while another thread plans. While no published
+  // policy covers the state they call request_plan, a sparse task queuing
+  // the state first, and wait for the next policy; once the flag is cleared
+  // they plan themselves instead. False by default, set by
+  // MTA::StartBackgroundPlanner.
+  atomic<bool> use_published_policy;
+  // Wakes the thread publishing the policies. Set before
+  // use_published_policy.
+  function<void()> request_plan;
+  // Wakes the threads waiting for a policy, e.g. after clearing
+  // use_published_policy.
+  void NotifyPolicyWaiters();
+  // Age of the published policy, in actions served since it was published
+  // and in seconds since it was solved. -1 if none is published.
+  long PolicyAgeSteps() const;
+  double PolicyAgeSeconds() const;
+  // Adds the states queued by SelectBestAction. Called by the planner.
+  // Returns false if there were none.
+  bool AddRequestedStates();
+
+  // Solves the task MDP with the current transition and reward functions,
+  // as SelectBestAction does. Returns the number of state backups, or for a
+  // factored task the number of decision diagram nodes built.
+  long Solve();
+  // Same, but only until the best action of state is certain, see
+  // ValueIteration::solveForAction, or until max_backups backups (0 for no
+  // limit). Sets best_action and returns true if it is proven optimal.
+  // A factored task solves to the precision of Solve and returns false.
+  bool SolveForAction(int state, int& best_action, long max_backups = 0);
+
+  // If true (the default), SelectBestAction re-plans from the previous values
+  // and only backs up states affected by transitions or rewards that changed
+  // since the last plan, skipping the solve when nothing changed.
+  // If false, every plan is a full value iteration.
+  bool incremental_planning;
+  // If true, a dense task does not store the next states of its explored
+  // (state, action) pairs: value iteration computes each of their backups
+  // from the cdtb cells, enumerating the components in order and sharing the
+  // partial products of the probabilities. The table then only holds the
+  // transitions to the fictitious state, which trades memory for compute.
+  // Solves sweep every state instead of prioritized sweeping, and RTDP
+  // trials stop at those pairs. Set before the first construction. Sparse
+  // tasks find their states through the stored entries, so they ignore it.
+  // False by default.
+  bool matrix_free;
+  // The expected value of values at the next state of (state, action), from
+  // the cdtb. Used by value iteration when matrix_free is set.
+  virtual double ExpectedValue(long state, long action, const vector<double>& values) const;
+
+  // If true, the task plans with structured value iteration: its values and
+  // action values are decision diagrams over the task features, and each
+  // Bellman backup regresses the value diagram through the cdtb cells one
+  // component at a time, with the probabilities of each component value
+  // being a diagram over the parent features of the cell. The diagrams only
+  // test the features the values depend on, and the cells only list the
+  // parent values explored, so no flat state space or transition function is
+  // built. Rewards come from SetFactoredReward, every action is applicable,
+  // and SelectBestAction and SelectBestActionWithin evaluate the action
+  // values at the current state. Set before the first construction, on a
+  // sparse task so the tables are never allocated. FSA parents read the
+  // next step, so FSA tasks ignore it. False by default.
+  bool factored;
+  // Sets the reward of the factored solver: reward(state, action) for every
+  // value of reward_features, with state holding those features and action
+  // being global. Rewards are rmax until it is called.
+  void SetFactoredReward(const vector<bool>& reward_features,
+      const function<double(const vector<int>& state, int action)>& reward);
+  // The value at state, holding every feature, of the last factored solve.
+  double FactoredValue(const vector<int>& state) const;
+  // Nodes of the value and action value diagrams of the last factored solve.
+  long FactoredNodes() const {return factored_solution ? factored_solution->NumNodes() : 0;};
+
+  // If true, SelectBestAction plans with SolveForAction, stopping as soon as
+  // its action is certain to be the best. The bounds assume no reward
+  // exceeds rmax. False by default.
+  bool action_gap_termination;
+  // Whether the last action selected with action_gap_termination was proven
+  // optimal, rather than the best one at the precision of the solve.
+  bool LastActionProven() const {return last_action_proven;};
 
   // Not all actions are available at every state.
-  // Set to false for non-applicable actions.
-  vector<vector<bool> > applicable_actions;
+  // Set to false for non-applicable actions, at state * total_actions + action.
+  vector<bool> applicable_actions;
 
   // This is the value of the task states.
   vector<double> values;
 
+  // Phase timers and counters of the task, disabled by default.
+  Metrics metrics;
+  // A copy of metrics with the table sizes filled in.
+  Metrics MetricsSnapshot() const;
+
   // The pointer is freed in the destructor.
   ValueIteration* vi;
   bool fsa;
+
+ private:
+  TaskPlan plan;
+
+  // Working space of one thread running FindNextStates.
+  struct Scratch {
+    vector<int> current_state;
+    vector<int> next_state;
+    vector<int> counter;
+    vector<int> parents;
+    // The entries found.
+    vector<long> next;
+    vector<double> prob;
+  };
+  // Finds the entries of (state, action) into scratch, without changing the
+  // task. Returns true if the state transits to the fictitious state.
+  bool ComputeNextStates(int state, int action, Scratch& scratch) const;
+  // Sums probability times values at the next states of (state, action)
+  // into expected, or with null values only checks whether the pair is
+  // explored. Returns true if it transits to the fictitious state.
+  bool SumNextValues(int state, int action, const double* values,
+      Scratch& scratch, double& expected) const;
+  // Adds the next states from position l of the component order on, given
+  // the values of the components before, which encode to key.
+  bool SumComponentValues(int l, const Distribution* const* cells, int key,
+      double probability, const double* values, Scratch& scratch,
+      double& expected) const;
+  bool MatrixFree() const {return matrix_free && !sparse;};
+  // Whether entries left to ExpectedValue were rebuilt since the last plan.
+  bool unstored_changes;
+  bool Factored() const {return factored && !fsa;};
+  // The model of the factored solver, built into factored_diagram.
+  struct FactoredModel {
+    // By local action: the rewards, and 1 where every cell of the action
+    // has its parent value explored, 0 elsewhere. Empty when not built.
+    vector<DecisionDiagram::Node> reward;
+    vector<DecisionDiagram::Node> known;
+    // By cell, indexed like plan.cells: the component values seen given an
+    // explored parent value, their probabilities given the parents, the
+    // explored parent values and the version of the cell they were built
+    // from, -1 when not built.
+    vector<vector<int> > outcomes;
+    vector<vector<DecisionDiagram::Node> > probabilities;
+    vector<DecisionDiagram::Node> explored;
+    vector<long> versions;
+  };
+  // Builds the parts of factored_model whose cells changed since.
+  void UpdateFactoredModel();
+  // The expected value of the diagram values at the next state under local
+  // action, regressing one component at a time. Memoized in regressed.
+  DecisionDiagram::Node Regress(int action, DecisionDiagram::Node values,
+      unordered_map<DecisionDiagram::Node, DecisionDiagram::Node>& regressed);
+  // Runs structured value iteration unless no cell changed since the last
+  // one. Returns the number of diagram nodes built.
+  long SolveFactored();
+  // The best local action at state under the factored solution.
+  int FactoredAction(const DecisionDiagram& diagram,
+      const vector<DecisionDiagram::Node>& action_values,
+      const vector<int>& state) const;
+  // Rewards of SetFactoredReward by local action and flat value of
+  // reward_codec, empty until it is called.
+  StateCodec reward_codec;
+  vector<double> factored_reward;
+  // The local component of every task feature, -1 for other features.
+  vector<int> feature_component;
+  // The diagram the factored solver works in, holding the model and the
+  // values of the last solve. Replaced by a new one once it grows too large.
+  unique_ptr<DecisionDiagram> factored_diagram;
+  FactoredModel factored_model;
+  DecisionDiagram::Node factored_working_values;
+  // The solution of the last factored solve, never changed once built.
+  shared_ptr<const DecisionDiagram> factored_solution;
+  DecisionDiagram::Node factored_values;
+  vector<DecisionDiagram::Node> factored_action_values;
+  // Writes entries found by ComputeNextStates to the transition function.
+  void CommitNextStates(int state, int action, bool fictitious,
+      const long* next, const double* prob, long count);
+  // Runs FindNextStates on the count (state, action) pairs given by entry,
+  // in parallel when there are threads.
+  void FindNextStatesOfEntries(long count,
+      const function<pair<int, int>(long)>& entry);
+
+  Scratch scratch;
+  shared_ptr<ThreadPool> thread_pool;
+  // The entries of a parallel chunk. counts holds the number of entries of
+  // every (state, action), -1 for the fictitious state.
+  struct EntryChunk {
+    Scratch scratch;
+    vector<long> counts;
+    vector<long> next;
+    vector<double> prob;
+  };
+  vector<EntryChunk> entry_chunks;
+  // (state, action) pairs per parallel chunk; a multiple of total_actions
+  // so chunks hold whole states when constructing.
+  long entry_grain;
+
+  // True if some cdtb cell used by the task changed since the transition
+  // function was last constructed.
+  bool CdtbChangedSinceConstruction();
+  void RecordCdtbVersions();
+  // Sizes the codec and the tables to the features, with no state computed.
+  void InitializeStates();
+  // Fills the reverse index of the cdtb, or extends it to the states
+  // computed since.
+  void BuildDependencies();
+
+  // Builds the transition function of every state, or for sparse tasks of
+  // the states added since the last construction.
+  void ConstructStates();
+  // For sparse tasks: computes the states from begin on and those they lead
+  // to, until no new state is found.
+  void ExpandStates(int begin);
+  // Sizes the tables of a sparse task to the states in state_index.
+  void GrowStates();
+  // Flat state of a held state, and the held state of a flat state.
+  int StateKey(int index) const {return sparse ? state_index.Key(index - 1) : index;};
+  int StateOfKey(long key) {return sparse ? state_index.Insert(key) + 1 : key;};
+  // Flat states of a sparse task, by index minus one.
+  StateIndex state_index;
+  // States of a sparse task whose transitions are computed.
+  int expanded_states;
+  // Next states of an entry mapped to held states.
+  vector<long> mapped_next;
+
+  // Reverse index of the cdtb: the list of cell c = a * total_components + k
+  // and parent value parent holds the states whose transition under local
+  // action a reads that parent value of the cell of local component k and
+  // action a. For FSA it covers every value the next step part of the parent
+  // can take. The lists are linked through dependent_next in a few flat
+  // arrays, so extending them never allocates per list: list
+  // dependent_offsets[c] + parent starts at dependent_heads and ends at
+  // dependent_tails, -1 when empty, and every entry holds its state.
+  vector<int> dependent_offsets;
+  vector<int> dependent_heads;
+  vector<int> dependent_tails;
+  vector<int> dependent_state;
+  vector<int> dependent_next;
+  // Appends state to the list of cell and parent.
+  void AddDependent(int cell, int parent, int state);
+  // Number of states covered by the reverse index.
+  int dependent_states;
+  // Entries to rebuild in RefreshTransitions, indexed by state and action.
+  vector<bool> dirty;
+  vector<pair<int, int> > dirty_entries;
+  // Adds the states whose transitions or rewards changed since the last plan
+  // to changed_states, and clears the changes of the tables.
+  void CollectChangedStates();
+  // Empties changed_states once a plan accounted for them.
+  void ClearChangedStates();
+
+  // Versions of the cdtb cells used by the task, indexed like plan.cells,
+  // at the last construction. Empty before the first one.
+  vector<long> constructed_versions;
+  // Whether vi holds a solution of an earlier model.
+  bool planned;
+  bool last_action_proven;
+  shared_ptr<const Policy> published_policy;
+  // Notified when a policy is published.
+  mutex policy_mutex;
+  condition_variable policy_published;
+  // Flat states of a sparse task requested through a published policy.
+  mutex requested_mutex;
+  vector<long> requested_states;
+  // The action of the newest published policy at current_state, waiting for
+  // one that covers the state. -1 if use_published_policy was cleared.
+  int ServePublishedPolicy(const vector<int>& current_state);
+  // Adds the statistics of the last solve to the metrics.
+  void CountSolve();
+  // States changed since the last plan, including those restored from a
+  // checkpoint, each once, and whether each state is in the list.
+  vector<long> changed_states;
+  vector<bool> changed_flag;
 };
 
@@ -0,0 +1,218 @@
+// Checks that the solver and learner variants meant to agree do agree:
+// parallel and serial Jacobi value iteration, sparse and dense tasks,
+// matrix-free and stored backups, batch and sequential ingestion, and a
+// checkpoint and its reload. Prints one line per check and exits with 1 if
+// any fails.
+//
+// Build from the repository root with
+//   g++ -std=c++11 -O2 -pthread -I. tests/consistency_test.cpp
+//       benchmarks/synthetic_mta.cpp mta.cpp task.cpp Utility.cpp
+//       ValueIteration.cc RewardTable.cc TransitionTable.cc ThreadPool.cc
+//       StateCodec.cpp Checkpoint.cpp Metrics.cpp StateIndex.cpp
+//       ExperienceBuffer.cpp DecisionDiagram.cc -o consistency_test
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include "ThreadPool.h"
+#include "ValueIteration.h"
+#include "benchmarks/synthetic_mta.h"
+
+using namespace std;
+
+int failures = 0;
+
+void Check(bool ok, const char* what) {
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+// A random sparse MDP, as in solver_benchmark.
+void GenerateMDP(long states, long actions, long successors,
+    RewardTable& reward, TransitionTable& transition) {
+  transition.Reset(states, actions);
+  reward.Reset(states, actions, 0);
+  vector<long> next(successors);
+  vector<double> prob(successors);
+  for (long s = 0; s < states - 1; ++s) {
+    for (long a = 0; a < actions; ++a) {
+      double total = 0;
+      for (long k = 0; k < successors; ++k) {
+        next[k] = (s + states - 32 + rand() % 64) % states;
+        prob[k] = 1 + rand() % 100;
+        total += prob[k];
+      }
+      for (long k = 0; k < successors; ++k)
+        prob[k] /= total;
+      transition.Assign(s, a, next.data(), prob.data(), successors);
+      reward.Set(s, a, (rand() % 100) / 1000.0);
+    }
+  }
+  for (long a = 0; a < actions; ++a) {
+    transition.Assign(states - 1, a, states - 1, 1.0);
+    reward.Set(states - 1, a, 1);
+  }
+}
+
+void CheckParallelJacobi() {
+  const long states = 20000, actions = 4;
+  srand(1);
+  RewardTable reward;
+  TransitionTable transition;
+  GenerateMDP(states, actions, 4, reward, transition);
+
+  vector<double> serial_values(states, 10), parallel_values(states, 10);
+  ValueIteration serial(states, actions, 0.9, serial_values);
+  ValueIteration parallel(states, actions, 0.9, parallel_values);
+  serial.setSolver(ValueIteration::JACOBI);
+  parallel.setSolver(ValueIteration::JACOBI);
+  parallel.setThreadPool(make_shared<ThreadPool>(4));
+  serial.doValueIteration(reward, transition, 1e-6);
+  parallel.doValueIteration(reward, transition, 1e-6);
+  Check(serial.values == parallel.values && serial.actions == parallel.actions,
+      "parallel Jacobi equals serial Jacobi bit for bit");
+}
+
+// Packed random observations of the ground truth of config, as
+// UpdateWithNewObservations takes them.
+vector<int> Observations(const SyntheticConfig& config, long count) {
+  SyntheticMTA truth(config);
+  truth.Setup();
+  vector<int> observations;
+  for (long i = 0; i < count; ++i) {
+    vector<int> state = truth.RandomState();
+    int action = truth.RandomAction();
+    vector<int> next = truth.Step(state, action);
+    observations.insert(observations.end(), state.begin(), state.end());
+    observations.push_back(action);
+    observations.insert(observations.end(), next.begin(), next.end());
+  }
+  return observations;
+}
+
+void Feed(SyntheticMTA& learner, const vector<int>& observations, bool batch) {
+  int features = learner.feature_size.size();
+  long stride = 2 * features + 1;
+  long count = observations.size() / stride;
+  if (batch) {
+    learner.UpdateWithNewObservations(observations.data(), count);
+    return;
+  }
+  for (long i = 0; i < count; ++i) {
+    const int* observation = observations.data() + i * stride;
+    vector<int> last(observation, observation + features);
+    vector<int> curr(observation + features + 1, observation + stride);
+    learner.UpdateWithNewObservation(last, observation[features], curr, 0);
+  }
+}
+
+// Plans every task of learner from the visited states.
+void Plan(SyntheticMTA& learner, const vector<int>& observations) {
+  int features = learner.feature_size.size();
+  long stride = 2 * features + 1;
+  for (auto i : learner.tasks) {
+    for (unsigned long o = 0; o < observations.size(); o += stride)
+      i.second->AddState(vector<int>(&observations[o], &observations[o] + features));
+  }
+  map<string, future<long> > backups = learner.PlanAll();
+  for (auto& i : backups)
+    i.second.get();
+}
+
+string ReadFile(const string& path) {
+  ifstream in(path.c_str(), ios::binary);
+  return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+void CheckLearners() {
+  SyntheticConfig config;
+  config.features = 8;
+  config.features_per_task = 4;
+  vector<int> observations = Observations(config, 3000);
+  int features = config.features;
+  long stride = 2 * features + 1;
+
+  SyntheticMTA dense(config);
+  dense.Setup();
+  Feed(dense, observations, false);
+  Plan(dense, observations);
+
+  // Sparse and dense tasks give every held state the same value.
+  SyntheticConfig sparse_config = config;
+  sparse_config.sparse = true;
+  SyntheticMTA sparse(sparse_config);
+  sparse.Setup();
+  Feed(sparse, observations, false);
+  Plan(sparse, observations);
+  bool same = true;
+  for (const string& name : dense.task_names) {
+    Task* dense_task = dense.tasks[name];
+    Task* sparse_task = sparse.tasks[name];
+    for (unsigned long o = 0; o < observations.size(); o += stride) {
+      vector<int> state(&observations[o], &observations[o] + features);
+      same = same && dense_task->vi->values[dense_task->AddState(state)] ==
+          sparse_task->vi->values[sparse_task->AddState(state)];
+    }
+  }
+  Check(same, "sparse tasks equal dense tasks bit for bit");
+
+  // Matrix-free backups only sum in another order.
+  SyntheticMTA matrix_free(config);
+  matrix_free.Setup();
+  for (auto i : matrix_free.tasks)
+    i.second->matrix_free = true;
+  Feed(matrix_free, observations, false);
+  Plan(matrix_free, observations);
+  double diff = 0;
+  for (const string& name : dense.task_names) {
+    const vector<double>& dense_values = dense.tasks[name]->vi->values;
+    const vector<double>& free_values = matrix_free.tasks[name]->vi->values;
+    for (unsigned long s = 0; s < dense_values.size(); ++s)
+      diff = max(diff, fabs(dense_values[s] - free_values[s]));
+  }
+  printf("     matrix-free max difference %g\n", diff);
+  Check(diff < 1e-12, "matrix-free values are within 1e-12 of stored ones");
+
+  SyntheticMTA batch(config);
+  batch.Setup();
+  Feed(batch, observations, true);
+  Plan(batch, observations);
+  string sequential_path = "consistency_test_sequential.ckpt";
+  string batch_path = "consistency_test_batch.ckpt";
+  Check(dense.SaveCheckpoint(sequential_path) && batch.SaveCheckpoint(batch_path) &&
+      ReadFile(sequential_path) == ReadFile(batch_path),
+      "batch ingestion equals sequential ingestion byte for byte");
+
+  // Load raises the version of every transition table, a long per task, and
+  // nothing else changes.
+  SyntheticMTA reloaded(config);
+  reloaded.Setup();
+  string reloaded_path = "consistency_test_reloaded.ckpt";
+  bool loaded = reloaded.LoadCheckpoint(sequential_path) &&
+      reloaded.SaveCheckpoint(reloaded_path);
+  string saved = ReadFile(sequential_path), resaved = ReadFile(reloaded_path);
+  long spans = 0;
+  long span_start = -8;
+  for (unsigned long i = 0; loaded && i < saved.size() && i < resaved.size(); ++i) {
+    if (saved[i] != resaved[i] && static_cast<long>(i) >= span_start + 8) {
+      spans++;
+      span_start = i;
+    }
+  }
+  Check(loaded && saved.size() == resaved.size() &&
+      spans <= static_cast<long>(dense.task_names.size()),
+      "a reloaded checkpoint saves again with only the versions changed");
+  remove(sequential_path.c_str());
+  remove(batch_path.c_str());
+  remove(reloaded_path.c_str());
+}
+
+int main() {
+  CheckParallelJacobi();
+  CheckLearners();
+  return failures > 0 ? 1 : 0;
+}